@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "knn.h"
+
+/* A microbenchmark comparing load_image with the original fscanf based
+ * loader on every image named in a list file.
+ *
+ * compile this program with "make bench_loadimage"
+ *    ./bench_loadimage lists/training_full.txt
+ */
+
+/* The fscanf based loader load_image used to be.
+ */
+void load_image_fscanf(char *filename, unsigned char *img) {
+    FILE *f2 = fopen(filename, "r");
+    if (f2 == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    int width, height;
+    fscanf(f2, "P2 %d %d 255 ", &width, &height);
+    for (int i = 0; i < width * height; i++) {
+        fscanf(f2, "%hhu ", &img[i]);
+    }
+    fclose(f2);
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned char fast[NUM_PIXELS];
+unsigned char slow[NUM_PIXELS];
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s image_list\n", argv[0]);
+        exit(1);
+    }
+    FILE *f = fopen(argv[1], "r");
+    if (f == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+
+    char line[MAX_NAME + 1];
+    int n = 0;
+    double t_fast = 0, t_slow = 0;
+    while (fgets(line, MAX_NAME + 1, f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        double t0 = now();
+        load_image_fscanf(line, slow);
+        double t1 = now();
+        load_image(line, fast);
+        double t2 = now();
+        t_slow += t1 - t0;
+        t_fast += t2 - t1;
+        if (memcmp(fast, slow, NUM_PIXELS) != 0) {
+            fprintf(stderr, "%s: loaders disagree\n", line);
+            exit(1);
+        }
+        n++;
+    }
+    fclose(f);
+
+    if (n == 0) {
+        fprintf(stderr, "%s lists no images\n", argv[1]);
+        exit(1);
+    }
+    printf("%d images\n", n);
+    printf("fscanf loader: %8.3f s  %7.2f us/image\n", t_slow, 1e6 * t_slow / n);
+    printf("load_image:    %8.3f s  %7.2f us/image\n", t_fast, 1e6 * t_fast / n);
+    printf("speedup:       %8.2fx\n", t_slow / t_fast);
+    return 0;
+}
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "knn.h"
 
 /**
@@ -16,6 +18,15 @@
  *
  * Running full evaluation with all images, K = 7: (Will take a while)
  *    ./classifier 7 lists/training_full.txt lists/testing_full.txt
+ *
+ * Loading the images with 8 threads and classifying with 32:
+ *    ./classifier -j 8 -t 32 7 lists/training_full.txt lists/testing_full.txt
+ *
+ * Classifying the black and white (binarized) images by hamming distance:
+ *    ./classifier -d hamming 7 lists/training_full.txt lists/testing_full.txt
+ *
+ * Searching a vantage-point tree (saved as lists/training_full.txt.vpt):
+ *    ./classifier -i vptree 7 lists/training_full.txt lists/testing_full.txt
  */
 
 /*****************************************************************************/
@@ -28,6 +39,18 @@
  *    - K : The K value for K nearest neighbours
  *    - training_list: Name of a file with paths to a set of training images
  *    - testing_list:  Name of a file with paths to a set of testing images
+ * and the following options, which must come before them:
+ *    -j <num_threads>: The number of threads used to load the images
+ *    -t <num_threads>: The number of threads used to classify the test
+ *                      images. Per-thread throughput goes to stderr.
+ *    -w <vote>: How the K nearest images vote: majority (the default),
+ *               distance (weighted by 1/distance) or rank (weighted by
+ *               nearness rank). Initial substrings such as "dist" work too.
+ *    -d <metric>: euclidean (the default), or hamming to compare the images
+ *                 binarized at BIT_THRESHOLD. Initial substrings work too.
+ *    -i <index>: none (the default) to compare every training image, or
+ *                vptree to search a vantage-point tree over them (euclidean
+ *                only). The predictions are the same.
  *
  * You need to do the following:
  *    - Parse the command line arguments, call `load_dataset()` appropriately.
@@ -36,71 +59,141 @@
  *      (Do not print any other output)
  */
 
-/* To store the data from the training and test datasets, we are using a 
- * series of arrays.  Generally speaking, this is a poor design decision
- * because global variables like this are frowned upon, because we are 
- * allocating more memory than necessary, and the code would be more 
- * readable if we could collect data that belonged together into objects
- * (structs).  It is also inflexible, because we cannot handle different 
- * image sizes.
- * 
- * However, we are using this approach because we have not yet covered
- * structs or dynamic memory allocation.
- */
-
-/* training_dataset - a 2D array where each row contains the pixels for a 
- *                    training image
- * training_labels - an array that contains the labels for each image in
- *                   training_data set indicating which digit the image
- *                   represents
- * test_dataset - a 2D array where each row contains the pixels for an image
- *                that we want to classify
- * test_labels - an array containing the labels for the test images so we
- *               can tell whether the prediction was correct
+/* The training and test images are each loaded into an ImageSet (see
+ * knn.h), which is allocated to fit the number of images in the list file.
  */
-unsigned char training_dataset[MAX_SIZE][NUM_PIXELS];
-unsigned char training_labels[MAX_SIZE];
-unsigned char test_dataset[MAX_SIZE][NUM_PIXELS];
-unsigned char test_labels[MAX_SIZE];
-
 
 int main(int argc, char *argv[]) {  
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s K training_list test_images\n", argv[0]);
-        exit(1);
+    int opt;
+    int num_load_threads = 1;
+    int num_threads = 1;
+    int vote = VOTE_MAJORITY;
+    int hamming = 0;
+    int vptree = 0;
+    while ((opt = getopt(argc, argv, "+j:t:w:d:i:")) != -1) {
+        switch (opt) {
+        case 'j':
+            num_load_threads = atoi(optarg);
+            if (num_load_threads < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            if (strncmp(optarg, "majority", strlen(optarg)) == 0) {
+                vote = VOTE_MAJORITY;
+            } else if (strncmp(optarg, "distance", strlen(optarg)) == 0) {
+                vote = VOTE_DISTANCE;
+            } else if (strncmp(optarg, "rank", strlen(optarg)) == 0) {
+                vote = VOTE_RANK;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "none") == 0) {
+                vptree = 0;
+            } else if (strcmp(optarg, "vptree") == 0) {
+                vptree = 1;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            if (strncmp(optarg, "euclidean", strlen(optarg)) == 0) {
+                hamming = 0;
+            } else if (strncmp(optarg, "hamming", strlen(optarg)) == 0) {
+                hamming = 1;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || (vptree && hamming)) {
+        usage(argv[0]);
+    }
+    char *training_file_list = argv[optind + 1];
+    char *test_file_list = argv[optind + 2];
+    int K = strtod(argv[optind], NULL);
+    if (K < 1) {
+        usage(argv[0]);
     }
-    char *training_file_list = argv[2];
-    char *test_file_list = argv[3];
-    int K = strtod(argv[1], NULL);
 
-    int num_training_files = 0;
-    int num_test_files = 0;
     int num_correct = 0;
 
     printf("Loading training data...\n");
 
-    // TODO: (use load_dataset)
-    num_training_files = load_dataset(training_file_list, training_dataset, training_labels);
+    ImageSet *training = load_image_set(training_file_list, num_load_threads);
+    int num_training_files = training->num_items;
+    order_blocks_by_variance(training);
+    if (vptree) {
+        attach_vptree(training, training_file_list);
+    }
 
     printf("Loading testing data...\n");
 
-    // TODO: (use load_dataset)
-    num_test_files = load_dataset(test_file_list, test_dataset, test_labels);
+    ImageSet *test = load_image_set(test_file_list, num_load_threads);
+    int num_test_files = test->num_items;
+    if (hamming) {
+        binarize_image_set(training);
+        binarize_image_set(test);
+    }
     
 
-    /* TODO: for each image in the test image dataset, call knn_predict
-     * to make a prediction for what digit is represented.  If the
-     * prediction matches the test image label, then increment the number
-     * of correct predictions.  Hint: the return value of load_dataset tells
-     * you how many images of each type you have.
+    /* Predict the digit of every test image at once, with the predictor
+     * for the chosen index or metric (split between num_threads threads
+     * if there is more than one), then count the predictions that match
+     * the test labels.
      */
 
+    int *predictions = malloc(sizeof(int) * (num_test_files > 0 ? num_test_files : 1));
+    if (predictions == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (num_threads == 1 && vptree) {
+        knn_predict_vptree(test->images, num_test_files, K, training, vote, predictions);
+    } else if (num_threads == 1 && hamming) {
+        knn_predict_hamming(test->bits, num_test_files, K, training->bits,
+                            training->labels, num_training_files, vote, predictions);
+    } else if (num_threads == 1) {
+        knn_predict_batch(test->images, num_test_files, K, training, vote, predictions);
+    } else {
+        ThreadStats stats[num_threads];
+        if (vptree) {
+            knn_predict_parallel_vptree(test->images, num_test_files, K, training, vote,
+                                        predictions, num_threads, stats);
+        } else if (hamming) {
+            knn_predict_parallel_hamming(test->bits, num_test_files, K, training->bits,
+                                         training->labels, num_training_files, vote,
+                                         predictions, num_threads, stats);
+        } else {
+            knn_predict_parallel(test->images, num_test_files, K, training, vote, predictions,
+                                 num_threads, stats);
+        }
+        for (int t = 0; t < num_threads; t++) {
+            fprintf(stderr, "thread %2d: %6d images in %7.3f s (%9.1f images/s), %d steals\n",
+                    t, stats[t].images, stats[t].seconds,
+                    stats[t].seconds > 0 ? stats[t].images / stats[t].seconds : 0.0,
+                    stats[t].steals);
+        }
+    }
     for (int i = 0; i < num_test_files; i++) {
-        if (knn_predict(test_dataset[i], K, training_dataset, training_labels, 
-        num_training_files) == test_labels[i]) {
+        if (predictions[i] == test->labels[i]) {
             num_correct += 1;
         }
     }
+    free(predictions);
+    free_image_set(training);
+    free_image_set(test);
 
 
     // Print out answer
@@ -2,6 +2,13 @@
 #include <math.h>    // Need this for sqrt()
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "knn.h"
 
@@ -30,39 +37,358 @@ unsigned char get_label(char *filename) {
     return (char) atoi(dash_char + 1);
 }
 
+/* Print the classifier's command line usage to stderr and exit.
+ */
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-j num_threads] [-t num_threads] [-w vote] [-d metric] [-i index] "
+            "K training_list test_images\n", name);
+    exit(1);
+}
+
 /* ******************************************************************
  * Complete the remaining functions below
  * ******************************************************************/
 
 
+/* Largest pgm file load_image accepts: a 28x28 P2 image takes at most
+ * 4 bytes per pixel plus a short header.
+ */
+#define MAX_PGM_BYTES 8192
+
+/* Skip whitespace and '#' comments starting at *p (but not past end).
+ */
+static void skip_space(const char **p, const char *end) {
+    while (*p < end) {
+        if (**p == '#') {
+            while (*p < end && **p != '\n') {
+                (*p)++;
+            }
+        } else if (**p == ' ' || **p == '\n' || **p == '\t' || **p == '\r') {
+            (*p)++;
+        } else {
+            return;
+        }
+    }
+}
+
+/* Parse a non-negative decimal integer at *p, advancing *p past it.
+ * Return -1 if there is no number at *p or it is larger than 65535.
+ */
+static int scan_uint(const char **p, const char *end) {
+    const char *s = *p;
+    int value = 0;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        value = value * 10 + (**p - '0');
+        if (value > 65535) {
+            return -1;
+        }
+        (*p)++;
+    }
+    return *p == s ? -1 : value;
+}
+
+/* Report a malformed pgm file and exit.
+ */
+static void pgm_error(char *filename, char *msg) {
+    fprintf(stderr, "%s: %s\n", filename, msg);
+    exit(1);
+}
+
 /* Read a pgm image from filename, storing its pixels
  * in the array img.
- * It is recommended to use fscanf to read the values from the file. First, 
- * consume the header information.  You should declare two temporary variables
- * to hold the width and height fields. This allows you to use the format string
- * "P2 %d %d 255 "
- * 
- * To read in each pixel value, use the format string "%hhu " which will store
- * the number it reads in an an unsigned character.
+ *
+ * The whole file is read with a single read() into a stack buffer and
+ * parsed in place, which is much cheaper than one fscanf call per pixel.
+ * Both the ASCII (P2) and binary (P5) formats are accepted. The image must
+ * be WIDTH x HEIGHT with a maximum value of at most 255; anything else is
+ * reported on stderr and the program exits.
+ * In a P5 file the pixels start right after the single whitespace byte that
+ * follows the maximum value, as the format requires, so a comment or a
+ * second whitespace byte there is read as pixel data.
  * (Note that the img array is a 1D array of length WIDTH*HEIGHT.)
  * ./test_loadimage datasets/testing/459-0.pgm
  */
 void load_image(char *filename, unsigned char *img) {
-    // Open corresponding image file, read in header (which we will discard)
-    FILE *f2 = fopen(filename, "r");
-    if (f2 == NULL) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    char buf[MAX_PGM_BYTES];
+    ssize_t len = 0, n;
+    while ((n = read(fd, buf + len, sizeof(buf) - len)) > 0) {
+        len += n;
+        if (len == sizeof(buf)) {
+            pgm_error(filename, "file is too large for a pgm image");
+        }
+    }
+    if (n == -1) {
+        perror("read");
+        exit(1);
+    }
+    close(fd);
+
+    const char *p = buf, *end = buf + len;
+    if (len < 2 || buf[0] != 'P' || (buf[1] != '2' && buf[1] != '5')) {
+        pgm_error(filename, "not a P2 or P5 pgm file");
+    }
+    int binary = buf[1] == '5';
+    p += 2;
+    int header[3];  // width, height, maximum value
+    for (int i = 0; i < 3; i++) {
+        skip_space(&p, end);
+        if ((header[i] = scan_uint(&p, end)) == -1) {
+            pgm_error(filename, "malformed pgm header");
+        }
+    }
+    if (header[0] != WIDTH || header[1] != HEIGHT) {
+        pgm_error(filename, "unexpected image dimensions");
+    }
+    int maxval = header[2];
+    if (maxval == 0 || maxval > 255) {
+        pgm_error(filename, "unsupported maximum pixel value");
+    }
+
+    if (binary) {
+        // Exactly one whitespace character separates the header from the pixels
+        if (p == end || end - (p + 1) < NUM_PIXELS) {
+            pgm_error(filename, "truncated pixel data");
+        }
+        if (*p != ' ' && *p != '\n' && *p != '\t' && *p != '\r') {
+            pgm_error(filename, "malformed pgm header");
+        }
+        memcpy(img, p + 1, NUM_PIXELS);
+        for (int i = 0; i < NUM_PIXELS; i++) {
+            if (img[i] > maxval) {
+                pgm_error(filename, "pixel value out of range");
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < NUM_PIXELS; i++) {
+        skip_space(&p, end);
+        int value = scan_uint(&p, end);
+        if (value == -1) {
+            pgm_error(filename, p == end ? "truncated pixel data" : "malformed pixel value");
+        }
+        if (value > maxval) {
+            pgm_error(filename, "pixel value out of range");
+        }
+        img[i] = value;
+    }
+}
+
+
+/* The pixels loaded from a list file are cached in "<list file>.cache" so
+ * that later runs do not have to parse every pgm file again. The cache file
+ * holds a header followed by one record per image, laid out like the A3 .bin
+ * files:
+ *
+ *     - sizeof(CacheHeader) bytes : magic, number of images and key
+ *     -   1 byte  : Image 1 label
+ *     - 784 bytes : Image 1 data (WIDTHxHEIGHT)
+ *          ...
+ *     -   1 byte  : Image N label
+ *     - 784 bytes : Image N data (WIDTHxHEIGHT)
+ *
+ * The key hashes the contents of the list file together with the size and
+ * modification time of every image it names, so the cache is only rebuilt
+ * when the list or one of the listed images changes.
+ */
+#define CACHE_MAGIC 0x31434e4b  // "KNC1"
+#define CACHE_RECORD (1 + NUM_PIXELS)
+
+typedef struct {
+    unsigned int magic;
+    int num_items;
+    unsigned long long key;
+} CacheHeader;
+
+/* Fold len bytes of buf into the 64-bit FNV-1a hash h.
+ */
+static unsigned long long fnv1a(unsigned long long h, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Read the image file names in the list file filename into *names (which is
+ * grown as needed) and return how many there are. Blank lines are skipped.
+ */
+static int read_list(char *filename, char (**names)[MAX_NAME + 1]) {
+    FILE *f1 = fopen(filename, "r");
+    if (f1 == NULL) {
         perror("fopen");
         exit(1);
     }
-	//TODO
-    int width, height;
-    fscanf(f2, "P2 %d %d 255 ", &width, &height);
-    for (int i = 0; i < width * height; i++) {
-        fscanf(f2, "%hhu ", &img[i]);
+    char line[MAX_NAME + 1];
+    int n = 0, capacity = 0;
+    *names = NULL;
+    while (fgets(line, MAX_NAME + 1, f1) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (n == capacity) {
+            capacity = capacity == 0 ? 1024 : 2 * capacity;
+            *names = realloc(*names, sizeof(**names) * capacity);
+            if (*names == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        strcpy((*names)[n], line);
+        n++;
+    }
+    fclose(f1);
+    return n;
+}
+
+/* Return the cache key for the n image files in names.
+ */
+static unsigned long long list_key(char (*names)[MAX_NAME + 1], int n) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    struct stat st;
+    for (int i = 0; i < n; i++) {
+        if (stat(names[i], &st) == -1) {
+            perror(names[i]);
+            exit(1);
+        }
+        long long stamp[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+        h = fnv1a(h, names[i], strlen(names[i]) + 1);
+        h = fnv1a(h, stamp, sizeof(stamp));
     }
-    fclose(f2);
+    return h;
 }
 
+/* Fill dataset and labels from the cache file at path if it holds n images
+ * with the given key. Return 1 on success, 0 if the cache is missing or stale.
+ */
+static int load_cache(char *path, unsigned long long key, int n,
+                      unsigned char dataset[][NUM_PIXELS],
+                      unsigned char *labels) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat st;
+    size_t size = sizeof(CacheHeader) + (size_t)n * CACHE_RECORD;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != size) {
+        close(fd);
+        return 0;
+    }
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    CacheHeader *header = (CacheHeader *)map;
+    int hit = header->magic == CACHE_MAGIC && header->num_items == n &&
+              header->key == key;
+    if (hit) {
+        unsigned char *record = map + sizeof(CacheHeader);
+        for (int i = 0; i < n; i++) {
+            labels[i] = record[0];
+            memcpy(dataset[i], record + 1, NUM_PIXELS);
+            record += CACHE_RECORD;
+        }
+    }
+    munmap(map, size);
+    return hit;
+}
+
+/* Write the n images in dataset and labels to the cache file at path. The
+ * file is written under a temporary name and renamed into place so a
+ * concurrent or interrupted run never sees a partial cache. Failing to write
+ * the cache is not an error; the next run just parses the images again.
+ */
+static void save_cache(char *path, unsigned long long key, int n,
+                       unsigned char dataset[][NUM_PIXELS],
+                       unsigned char *labels) {
+    char tmp[strlen(path) + 16];
+    sprintf(tmp, "%s.%d", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        return;
+    }
+    CacheHeader header = {CACHE_MAGIC, n, key};
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (int i = 0; ok && i < n; i++) {
+        ok = fwrite(&labels[i], 1, 1, f) == 1 &&
+             fwrite(dataset[i], 1, NUM_PIXELS, f) == NUM_PIXELS;
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+    }
+}
+
+/* Number of consecutive images a loader thread claims at a time.
+ */
+#define LOAD_CHUNK 64
+
+/* The images shared out between the threads of load_dataset_parallel.
+ */
+typedef struct {
+    char (*names)[MAX_NAME + 1];
+    int n;
+    int next;  // first image not yet claimed by a thread (updated atomically)
+    unsigned char (*dataset)[NUM_PIXELS];
+    unsigned char *labels;
+} LoadJob;
+
+/* Thread body: claim chunks of images until none are left and load each
+ * one straight into its row of the dataset.
+ */
+static void *load_worker(void *arg) {
+    LoadJob *job = arg;
+    int start;
+    while ((start = __atomic_fetch_add(&job->next, LOAD_CHUNK, __ATOMIC_RELAXED)) < job->n) {
+        int stop = start + LOAD_CHUNK < job->n ? start + LOAD_CHUNK : job->n;
+        for (int i = start; i < stop; i++) {
+            job->labels[i] = get_label(job->names[i]);
+            load_image(job->names[i], job->dataset[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Load the n images in names, listed in the file filename, into dataset
+ * and labels: from the cache if it is up to date, or by parsing them with
+ * num_threads threads (and rewriting the cache) otherwise.
+ */
+static void load_listed(char *filename, char (*names)[MAX_NAME + 1], int n,
+                        unsigned char dataset[][NUM_PIXELS], unsigned char *labels,
+                        int num_threads) {
+    unsigned long long key = list_key(names, n);
+
+    char cache[strlen(filename) + 7];
+    sprintf(cache, "%s.cache", filename);
+    if (load_cache(cache, key, n, dataset, labels)) {
+        return;
+    }
+    LoadJob job = {names, n, 0, dataset, labels};
+    if (num_threads > (n + LOAD_CHUNK - 1) / LOAD_CHUNK) {
+        num_threads = (n + LOAD_CHUNK - 1) / LOAD_CHUNK;
+    }
+    pthread_t threads[num_threads > 1 ? num_threads : 1];
+    for (int t = 1; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, load_worker, &job) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    load_worker(&job);
+    for (int t = 1; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    save_cache(cache, key, n, dataset, labels);
+}
 
 /**
  * Load a full dataset into a 2D array called dataset.
@@ -73,6 +399,9 @@ void load_image(char *filename, unsigned char *img) {
  * For each image i:
  *  - read the pixels into row i (using load_image)
  *  - set the image label in labels[i] (using get_label)
+ *
+ * The images are read from the cache next to filename when it is up to date,
+ * and the cache is (re)written after they have been parsed otherwise.
  * 
  * Return number of images read.
  * gcc -Wall -g -std=gnu99 -o test_loaddataset test_loaddataset.c knn.c -lm
@@ -81,64 +410,620 @@ void load_image(char *filename, unsigned char *img) {
 int load_dataset(char *filename, 
                  unsigned char dataset[MAX_SIZE][NUM_PIXELS],
                  unsigned char *labels) { 
-    // We expect the file to hold up to MAX_SIZE number of file names
-    FILE *f1 = fopen(filename, "r");
-    if (f1 == NULL) {
-        perror("fopen");
+    return load_dataset_parallel(filename, dataset, labels, 1);
+}
+
+/**
+ * Same as load_dataset, but when the images have to be parsed they are
+ * loaded by num_threads threads. Every image still goes to the row (and
+ * label slot) given by its position in the list, so the result is identical
+ * to a serial load.
+ */
+int load_dataset_parallel(char *filename,
+                          unsigned char dataset[MAX_SIZE][NUM_PIXELS],
+                          unsigned char *labels, int num_threads) {
+    char (*names)[MAX_NAME + 1];
+    int n = read_list(filename, &names);
+    if (n > MAX_SIZE) {
+        fprintf(stderr, "%s lists more than %d images\n", filename, MAX_SIZE);
         exit(1);
     }
-    char line[MAX_NAME + 1];
+    load_listed(filename, names, n, dataset, labels, num_threads);
+    free(names);
+    return n;
+}
+
+/**
+ * Load the images listed in filename (see load_dataset) into a newly
+ * allocated ImageSet. The list is read first so that the pixels of all
+ * images can be allocated exactly once, as one contiguous block aligned to
+ * a cache line; there is no limit on the number of images. Use num_threads
+ * threads to parse the images when they are not cached.
+ * Free the result with free_image_set.
+ */
+ImageSet *load_image_set(char *filename, int num_threads) {
+    char (*names)[MAX_NAME + 1];
+    int n = read_list(filename, &names);
+
+    ImageSet *set = malloc(sizeof(ImageSet));
+    if (set == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    set->num_items = n;
+    set->bits = NULL;
+    set->vptree = NULL;
+    for (int k = 0; k < NUM_BLOCKS; k++) {
+        set->block_order[k] = k;
+    }
+    size_t rows = n > 0 ? n : 1;
+    if (posix_memalign((void **)&set->images, 64, rows * sizeof(*set->images)) != 0 ||
+            (set->labels = malloc(rows)) == NULL) {
+        fprintf(stderr, "Could not allocate %d images for %s\n", n, filename);
+        exit(1);
+    }
+    load_listed(filename, names, n, set->images, set->labels, num_threads);
+    free(names);
+    return set;
+}
+
+/**
+ * Free an ImageSet returned by load_image_set. set may be NULL.
+ */
+void free_image_set(ImageSet *set) {
+    if (set == NULL) {
+        return;
+    }
+    free(set->images);
+    free(set->labels);
+    free(set->bits);
+    free_vptree(set);
+    free(set);
+}
+
+/**
+ * Fill in set->bits: row i holds the pixels of image i packed one bit per
+ * pixel, set if the pixel is at least BIT_THRESHOLD. For images that are
+ * black and white this is about an eighth of the size of the pixels, and
+ * distance_hamming compares two rows with a handful of popcounts.
+ */
+void binarize_image_set(ImageSet *set) {
+    if (set->bits != NULL) {
+        return;
+    }
+    size_t rows = set->num_items > 0 ? set->num_items : 1;
+    if (posix_memalign((void **)&set->bits, 64, rows * sizeof(*set->bits)) != 0) {
+        fprintf(stderr, "Could not allocate %d binarized images\n", set->num_items);
+        exit(1);
+    }
+    memset(set->bits, 0, rows * sizeof(*set->bits));
+    for (int i = 0; i < set->num_items; i++) {
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            if (set->images[i][p] >= BIT_THRESHOLD) {
+                set->bits[i][p / 64] |= 1ULL << (p % 64);
+            }
+        }
+    }
+}
+
+
+/* The bounded distance kernels compare the pixels one block at a time,
+ * visiting the blocks in the order they are given (the block_order of the
+ * training set), and stop as soon as the partial sum reaches the bound.
+ * Visiting the blocks where images differ most first (see
+ * order_blocks_by_variance) lets most candidates be rejected after a few
+ * blocks. Distances not taken against a training set visit them in order.
+ */
+_Static_assert(NUM_BLOCKS == 13, "natural_block_order must list every block");
+static const int natural_block_order[NUM_BLOCKS] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+
+/**
+ * Make the bounded distances to the images of set visit the pixel blocks
+ * in decreasing order of the variance of their pixels over those images.
+ * This only changes how quickly far away images are rejected, never the
+ * result.
+ */
+void order_blocks_by_variance(ImageSet *set) {
+    unsigned char (*dataset)[NUM_PIXELS] = set->images;
+    int n = set->num_items;
+    if (n == 0) {
+        return;
+    }
+    double score[NUM_BLOCKS] = {0};
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        unsigned long long sum = 0, sum_sq = 0;
+        for (int i = 0; i < n; i++) {
+            sum += dataset[i][p];
+            sum_sq += dataset[i][p] * dataset[i][p];
+        }
+        double mean = (double)sum / n;
+        score[p / BLOCK_PIXELS] += (double)sum_sq / n - mean * mean;
+    }
+    int order[NUM_BLOCKS];
+    for (int k = 0; k < NUM_BLOCKS; k++) {
+        // Average per pixel, since the last block may be short
+        int start = k * BLOCK_PIXELS;
+        int stop = start + BLOCK_PIXELS < NUM_PIXELS ? start + BLOCK_PIXELS : NUM_PIXELS;
+        score[k] /= stop - start;
+        // Insertion sort by decreasing score, ties in block order
+        int j = k;
+        while (j > 0 && score[order[j - 1]] < score[k]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = k;
+    }
+    memcpy(set->block_order, order, sizeof(order));
+}
+
+/* Squared distance between a and b, except that once the partial sum
+ * reaches bound the remaining blocks (in the order given by order) are
+ * skipped and the partial sum (which is then at least bound) is returned.
+ */
+static unsigned int distance_sq_bounded_scalar(unsigned char *a, unsigned char *b,
+                                               unsigned int bound, const int *order) {
+    unsigned int sum = 0;
+    for (int k = 0; k < NUM_BLOCKS && sum < bound; k++) {
+        int start = order[k] * BLOCK_PIXELS;
+        int stop = start + BLOCK_PIXELS < NUM_PIXELS ? start + BLOCK_PIXELS : NUM_PIXELS;
+        for (int i = start; i < stop; i++) {
+            int d = a[i] - b[i];
+            sum += d * d;
+        }
+    }
+    return sum;
+}
+
+/* Sum of squared differences between the NUM_PIXELS pixels of a and b.
+ * The largest possible value, 784 * 255^2, fits easily in 32 bits, so the
+ * kernels accumulate exactly in 32-bit integer lanes.
+ */
+static unsigned int distance_sq_scalar(unsigned char *a, unsigned char *b) {
+    unsigned int sum = 0;
+    for (int i = 0; i < NUM_PIXELS; i++) {
+        int d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// The vector kernels below process whole blocks of 16 pixels
+_Static_assert((NUM_PIXELS) % 16 == 0, "NUM_PIXELS must be a multiple of 16");
+
+/* SSE2 version: widen 16 pixels to 16-bit lanes, subtract, and let pmaddwd
+ * square and pairwise add the differences into 32-bit lanes.
+ */
+__attribute__((target("sse2")))
+static unsigned int distance_sq_sse2(unsigned char *a, unsigned char *b) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < NUM_PIXELS; i += 16) {
+        __m128i va = _mm_loadu_si128((__m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i *)(b + i));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(acc);
+}
+
+/* AVX2 version: the same computation on 32 pixels at a time.
+ */
+__attribute__((target("avx2")))
+static unsigned int distance_sq_avx2(unsigned char *a, unsigned char *b) {
+    __m256i acc = _mm256_setzero_si256();
     int i = 0;
-    //TODO
-    while (fgets(line, MAX_NAME + 1, f1) != NULL) {
-        strtok(line, "\n");
-        labels[i] = get_label(line);
-        load_image(line, dataset[i]);
-        i++;
+    for (; i + 32 <= NUM_PIXELS; i += 32) {
+        __m128i a0 = _mm_loadu_si128((__m128i *)(a + i));
+        __m128i a1 = _mm_loadu_si128((__m128i *)(a + i + 16));
+        __m128i b0 = _mm_loadu_si128((__m128i *)(b + i));
+        __m128i b1 = _mm_loadu_si128((__m128i *)(b + i + 16));
+        __m256i d0 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(a0), _mm256_cvtepu8_epi16(b0));
+        __m256i d1 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(a1), _mm256_cvtepu8_epi16(b1));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d0, d0));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d1, d1));
     }
-    fclose(f1);
-    return i;
+    for (; i + 16 <= NUM_PIXELS; i += 16) {
+        __m128i va = _mm_loadu_si128((__m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i *)(b + i));
+        __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(va), _mm256_cvtepu8_epi16(vb));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
     }
+    __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum4);
+}
+
+/* Squared differences of the 16 pixels at a and b, pairwise added into
+ * eight 32-bit lanes.
+ */
+__attribute__((target("avx2")))
+static inline __m256i sq_diff16_avx2(unsigned char *a, unsigned char *b) {
+    __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)a)),
+                                 _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)b)));
+    return _mm256_madd_epi16(d, d);
+}
+
+/* Sum of the eight 32-bit lanes of v.
+ */
+__attribute__((target("avx2")))
+static inline unsigned int hsum_avx2(__m256i v) {
+    __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum4);
+}
 
+/* AVX2 version of distance_sq_bounded_scalar.
+ */
+__attribute__((target("avx2")))
+static unsigned int distance_sq_bounded_avx2(unsigned char *a, unsigned char *b,
+                                             unsigned int bound, const int *order) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int k = 0; k < NUM_BLOCKS; k++) {
+        int start = order[k] * BLOCK_PIXELS;
+        if (start + BLOCK_PIXELS <= NUM_PIXELS) {
+            __m256i s0 = _mm256_add_epi32(sq_diff16_avx2(a + start, b + start),
+                                          sq_diff16_avx2(a + start + 16, b + start + 16));
+            __m256i s1 = _mm256_add_epi32(sq_diff16_avx2(a + start + 32, b + start + 32),
+                                          sq_diff16_avx2(a + start + 48, b + start + 48));
+            acc = _mm256_add_epi32(acc, _mm256_add_epi32(s0, s1));
+        } else {
+            for (int i = start; i < NUM_PIXELS; i += 16) {
+                acc = _mm256_add_epi32(acc, sq_diff16_avx2(a + i, b + i));
+            }
+        }
+        unsigned int sum = hsum_avx2(acc);
+        if (sum >= bound) {
+            return sum;
+        }
+    }
+    return hsum_avx2(acc);
+}
+
+/* AVX2 version of distance_sq_x4_bounded: each block of the training row
+ * is loaded and widened once and then compared with the same block of all
+ * four queries. It stops once none of the four can get under its bound.
+ */
+__attribute__((target("avx2")))
+static void distance_sq_x4_bounded_avx2(unsigned char **queries, unsigned char *row,
+                                        unsigned int *bounds, unsigned int *out,
+                                        const int *order) {
+    // The sums never exceed INT_MAX, so signed compares are safe
+    __m128i limit = _mm_setr_epi32(bounds[0] < INT_MAX ? bounds[0] : INT_MAX,
+                                   bounds[1] < INT_MAX ? bounds[1] : INT_MAX,
+                                   bounds[2] < INT_MAX ? bounds[2] : INT_MAX,
+                                   bounds[3] < INT_MAX ? bounds[3] : INT_MAX);
+    __m128i total = _mm_setzero_si128();
+    for (int k = 0; k < NUM_BLOCKS; k++) {
+        int start = order[k] * BLOCK_PIXELS;
+        int stop = start + BLOCK_PIXELS < NUM_PIXELS ? start + BLOCK_PIXELS : NUM_PIXELS;
+        __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+        __m256i acc2 = _mm256_setzero_si256(), acc3 = _mm256_setzero_si256();
+        for (int i = start; i < stop; i += 16) {
+            __m256i r = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(row + i)));
+            __m256i d0 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(queries[0] + i))), r);
+            __m256i d1 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(queries[1] + i))), r);
+            __m256i d2 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(queries[2] + i))), r);
+            __m256i d3 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(queries[3] + i))), r);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(d0, d0));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(d1, d1));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(d2, d2));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(d3, d3));
+        }
+        // Reduce the four accumulators to one lane each
+        __m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(acc0, acc1), _mm256_hadd_epi32(acc2, acc3));
+        total = _mm_add_epi32(total, _mm_add_epi32(_mm256_castsi256_si128(s),
+                                                   _mm256_extracti128_si256(s, 1)));
+        if (_mm_movemask_epi8(_mm_cmplt_epi32(total, limit)) == 0) {
+            break;
+        }
+    }
+    _mm_storeu_si128((__m128i *)out, total);
+}
+
+/* Hamming distance between two binarized rows with the popcnt instruction.
+ */
+__attribute__((target("popcnt")))
+static unsigned int distance_hamming_popcnt(unsigned long long *a, unsigned long long *b) {
+    unsigned int d = 0;
+    for (int i = 0; i < BIT_WORDS; i++) {
+        d += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return d;
+}
+
+_Static_assert(BIT_WORDS > 8 && BIT_WORDS <= 16, "the AVX-512 kernel counts two vectors");
+
+/* AVX-512 VPOPCNTQ version: xor the rows as one full and one masked vector
+ * of words and count the bits of all of them at once.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static unsigned int distance_hamming_avx512(unsigned long long *a, unsigned long long *b) {
+    __mmask8 tail = (1 << (BIT_WORDS - 8)) - 1;
+    __m512i lo = _mm512_xor_si512(_mm512_loadu_si512(a), _mm512_loadu_si512(b));
+    __m512i hi = _mm512_xor_si512(_mm512_maskz_loadu_epi64(tail, a + 8),
+                                  _mm512_maskz_loadu_epi64(tail, b + 8));
+    return _mm512_reduce_add_epi64(_mm512_add_epi64(_mm512_popcnt_epi64(lo),
+                                                    _mm512_popcnt_epi64(hi)));
+}
+#endif
+
+static unsigned int distance_hamming_scalar(unsigned long long *a, unsigned long long *b) {
+    unsigned int d = 0;
+    for (int i = 0; i < BIT_WORDS; i++) {
+        d += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return d;
+}
+
+static unsigned int distance_sq_resolve(unsigned char *a, unsigned char *b);
+static unsigned int distance_sq_bounded_resolve(unsigned char *a, unsigned char *b,
+                                                unsigned int bound, const int *order);
+static void distance_sq_x4_bounded_resolve(unsigned char **queries, unsigned char *row,
+                                           unsigned int *bounds, unsigned int *out,
+                                           const int *order);
+static unsigned int distance_hamming_resolve(unsigned long long *a, unsigned long long *b);
+
+/* The distance kernels for this CPU, picked on the first call.
+ */
+static unsigned int (*distance_sq_impl)(unsigned char *, unsigned char *) = distance_sq_resolve;
+static unsigned int (*distance_sq_bounded_impl)(unsigned char *, unsigned char *, unsigned int,
+                                                const int *) = distance_sq_bounded_resolve;
+static void (*distance_sq_x4_bounded_impl)(unsigned char **, unsigned char *, unsigned int *,
+                                           unsigned int *, const int *) =
+    distance_sq_x4_bounded_resolve;
+
+/* Store in out[j] the squared distance from row to queries[j], or a partial
+ * sum of at least bounds[j] once it is clear the distance is not below it.
+ */
+static void distance_sq_x4_bounded_generic(unsigned char **queries, unsigned char *row,
+                                           unsigned int *bounds, unsigned int *out,
+                                           const int *order) {
+    for (int j = 0; j < 4; j++) {
+        out[j] = distance_sq_bounded_impl(queries[j], row, bounds[j], order);
+    }
+}
+static unsigned int (*distance_hamming_impl)(unsigned long long *, unsigned long long *) =
+    distance_hamming_resolve;
+
+static void select_kernels(void) {
+    unsigned int (*impl)(unsigned char *, unsigned char *) = distance_sq_scalar;
+    unsigned int (*impl_bounded)(unsigned char *, unsigned char *, unsigned int, const int *) =
+        distance_sq_bounded_scalar;
+    void (*impl_x4)(unsigned char **, unsigned char *, unsigned int *, unsigned int *,
+                    const int *) = distance_sq_x4_bounded_generic;
+    unsigned int (*impl_hamming)(unsigned long long *, unsigned long long *) =
+        distance_hamming_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+        impl_hamming = distance_hamming_avx512;
+    } else if (__builtin_cpu_supports("popcnt")) {
+        impl_hamming = distance_hamming_popcnt;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        impl = distance_sq_avx2;
+        impl_bounded = distance_sq_bounded_avx2;
+        impl_x4 = distance_sq_x4_bounded_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        impl = distance_sq_sse2;
+    }
+#endif
+    __atomic_store_n(&distance_sq_impl, impl, __ATOMIC_RELAXED);
+    __atomic_store_n(&distance_sq_bounded_impl, impl_bounded, __ATOMIC_RELAXED);
+    __atomic_store_n(&distance_sq_x4_bounded_impl, impl_x4, __ATOMIC_RELAXED);
+    __atomic_store_n(&distance_hamming_impl, impl_hamming, __ATOMIC_RELAXED);
+}
+
+static unsigned int distance_sq_resolve(unsigned char *a, unsigned char *b) {
+    select_kernels();
+    return distance_sq_impl(a, b);
+}
+
+static unsigned int distance_sq_bounded_resolve(unsigned char *a, unsigned char *b,
+                                                unsigned int bound, const int *order) {
+    select_kernels();
+    return distance_sq_bounded_impl(a, b, bound, order);
+}
+
+static void distance_sq_x4_bounded_resolve(unsigned char **queries, unsigned char *row,
+                                           unsigned int *bounds, unsigned int *out,
+                                           const int *order) {
+    select_kernels();
+    distance_sq_x4_bounded_impl(queries, row, bounds, out, order);
+}
+
+static unsigned int distance_hamming_resolve(unsigned long long *a, unsigned long long *b) {
+    select_kernels();
+    return distance_hamming_impl(a, b);
+}
+
+/**
+ * Return the squared euclidean distance between the image pixels in the
+ * images a and b. This is exact, so comparing squared distances orders
+ * images exactly as comparing distance() does.
+ */
+unsigned int distance_sq(unsigned char *a, unsigned char *b) {
+    return distance_sq_impl(a, b);
+}
 
 /** 
  * Return the euclidean distance between the image pixels in the image
  * a and b.  (See handout for the euclidean distance function)
  */
 double distance(unsigned char *a, unsigned char *b) {
-    // TODO
-    double sum = 0;
-    for (int i = 0; i < NUM_PIXELS; i++) {
-        sum += pow((a[i] - b[i]), 2);
+    return sqrt(distance_sq(a, b));
+}
+
+/**
+ * Return the squared euclidean distance between a and b if it is less than
+ * bound. Otherwise the comparison may stop early, and some value that is
+ * at least bound is returned.
+ */
+unsigned int distance_sq_bounded(unsigned char *a, unsigned char *b, unsigned int bound) {
+    return distance_sq_bounded_impl(a, b, bound, natural_block_order);
+}
+
+/**
+ * Return the hamming distance between the binarized images a and b (rows
+ * of an ImageSet's bits): the number of pixels on different sides of
+ * BIT_THRESHOLD. It is also the squared euclidean distance between the
+ * images with every pixel replaced by its bit.
+ */
+unsigned int distance_hamming(unsigned long long *a, unsigned long long *b) {
+    return distance_hamming_impl(a, b);
+}
+
+/* A bounded max-heap holding the (at most) K nearest images seen so far.
+ * The root is the worst of them, so deciding whether a new image belongs
+ * in the set is O(1) and replacing the worst one is O(log K).
+ *
+ * It keeps the same images as the original scan, which held them in an
+ * array of K slots, filled the slots in order and then replaced the image
+ * in the first of the farthest slots whenever one strictly closer came
+ * along. So each image remembers its slot, a newcomer takes the slot of
+ * the image it replaces, and images are ordered by distance and then by
+ * slot, the lower slot being the worse of two at the same distance.
+ */
+typedef struct {
+    unsigned int dist;
+    int index;
+    int slot;       // Slot the image would be in in the original scan's array
+} Neighbour;
+
+typedef struct {
+    Neighbour *items;
+    int size;
+    int capacity;
+} TopK;
+
+static int neighbour_after(Neighbour *a, Neighbour *b) {
+    return a->dist > b->dist || (a->dist == b->dist && a->slot < b->slot);
+}
+
+static void topk_sift_down(TopK *h, int i) {
+    Neighbour item = h->items[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= h->size) {
+            break;
+        }
+        if (child + 1 < h->size && neighbour_after(&h->items[child + 1], &h->items[child])) {
+            child++;
+        }
+        if (!neighbour_after(&h->items[child], &item)) {
+            break;
+        }
+        h->items[i] = h->items[child];
+        i = child;
     }
-    sum = sqrt(sum);
-    return sum;
+    h->items[i] = item;
 }
 
+/* Return the distance a new image has to be under to get into the heap
+ * (UINT_MAX while it is not full yet, and for a heap of no images, which
+ * has no worst one to beat).
+ */
+static unsigned int topk_bound(TopK *h) {
+    return h->size < h->capacity || h->capacity <= 0 ? UINT_MAX : h->items[0].dist;
+}
+
+/* Offer image index at distance dist to the heap.
+ */
+static void topk_offer(TopK *h, unsigned int dist, int index) {
+    Neighbour item = {dist, index, h->size};
+    if (h->size < h->capacity) {
+        int i = h->size++;
+        while (i > 0 && neighbour_after(&item, &h->items[(i - 1) / 2])) {
+            h->items[i] = h->items[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        h->items[i] = item;
+    } else if (h->capacity > 0 && dist < h->items[0].dist) {
+        item.slot = h->items[0].slot;
+        h->items[0] = item;
+        topk_sift_down(h, 0);
+    }
+}
+
+/* Return the label with the largest weight in weights (the smallest
+ * label in the case of a tie).
+ */
+static int best_label(double weights[NUM_LABELS]) {
+    int best = 0;
+    for (int label = 1; label < NUM_LABELS; label++) {
+        if (weights[label] > weights[best]) {
+            best = label;
+        }
+    }
+    return best;
+}
+
+/* Return the most frequent of the n labels in a (the smallest label in
+ * the case of a tie).
+ */
 int mode(unsigned char a[], int n) {
-   int maxval = 0, maxcount = 0, i, j;
+    double counts[NUM_LABELS] = {0};
+    for (int i = 0; i < n; i++) {
+        counts[a[i]]++;
+    }
+    return best_label(counts);
+}
 
-   for (i = 0; i < n; i++) {
-      int count = 0;
-      
-      for (j = 0; j < n; j++) {
-         if (a[j] == a[i])
-         count++;
-      }
-      
-      if (count > maxcount) {
-         maxcount = count;
-         maxval = a[i];
-      }
+/* Order images by distance and then by index, nearest first (for qsort). */
+static int neighbour_compare(const void *a, const void *b) {
+    const Neighbour *x = a, *y = b;
+    if (x->dist != y->dist) {
+        return x->dist < y->dist ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
 
-      else if (count == maxcount) {
-          if (maxval > a[i]) {
-              maxval = a[i];
-          }
-      }
-   }
+/* Return the label chosen by the images in the heap using the given voting
+ * rule (see knn.h). Ties go to the smallest label.
+ */
+static int topk_vote(TopK *h, unsigned char *labels, int vote) {
+    double weights[NUM_LABELS] = {0};
+    if (vote == VOTE_MAJORITY) {
+        for (int i = 0; i < h->size; i++) {
+            weights[labels[h->items[i].index]]++;
+        }
+        return best_label(weights);
+    }
 
-   return maxval;
+    // The weights are added up nearest first, so that they come to the
+    // same sums however the images are laid out in the heap.
+    Neighbour sorted[h->size > 0 ? h->size : 1];
+    memcpy(sorted, h->items, sizeof(Neighbour) * h->size);
+    qsort(sorted, h->size, sizeof(Neighbour), neighbour_compare);
+    if (vote == VOTE_DISTANCE) {
+        // An exact match outweighs everything else, so if there are any
+        // only the exact matches vote.
+        int exact = 0;
+        for (int i = 0; i < h->size; i++) {
+            if (sorted[i].dist == 0) {
+                weights[labels[sorted[i].index]]++;
+                exact = 1;
+            }
+        }
+        for (int i = 0; !exact && i < h->size; i++) {
+            weights[labels[sorted[i].index]] += 1 / sqrt(sorted[i].dist);
+        }
+    } else {
+        // The nearest image gets size votes, the next size - 1 and so on.
+        for (int i = 0; i < h->size; i++) {
+            weights[labels[sorted[i].index]] += h->size - i;
+        }
+    }
+    return best_label(weights);
 }
 
 /**
@@ -167,36 +1052,680 @@ int knn_predict(unsigned char *input, int K,
                 unsigned char dataset[MAX_SIZE][NUM_PIXELS],
                 unsigned char *labels,
                 int training_size) {
+    // Squared distances order the images the same way as distances, so
+    // there is no need to take square roots here.
+    Neighbour items[K > 0 ? K : 1];
+    TopK nearest = {items, 0, K};
+    for (int i = 0; i < training_size; i++) {
+        // A distance at or above the bound cannot get into the heap, so
+        // there is no need to finish computing it.
+        unsigned int bound = topk_bound(&nearest);
+        topk_offer(&nearest, distance_sq_bounded(input, dataset[i], bound), i);
+    }
+    return topk_vote(&nearest, labels, VOTE_MAJORITY);
+}
+
+/* Number of test images (a tile) and of training images (a block) that
+ * knn_predict_batch processes together. A block of BATCH_ROWS training
+ * images is about 100KB, so it stays in L2 cache while every test image
+ * in the tile is compared with it.
+ */
+#define BATCH_QUERIES 8
+#define BATCH_ROWS 128
+
+/* Allocate room for the K nearest images of each of the BATCH_QUERIES test
+ * images of a tile.
+ */
+static Neighbour *new_batch_heaps(int K) {
+    Neighbour *items = malloc(sizeof(Neighbour) * BATCH_QUERIES * (K > 0 ? K : 1));
+    if (items == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return items;
+}
+
+static void predict_batch(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                          ImageSet *training, int vote, int *predictions, Neighbour *items);
+static void predict_hamming(unsigned long long inputs[][BIT_WORDS], int num_inputs, int K,
+                            unsigned long long dataset[][BIT_WORDS], unsigned char *labels,
+                            int training_size, int vote, int *predictions, Neighbour *items);
+
+/**
+ * Store in predictions[i] the label knn_predict would return for each of
+ * the num_inputs images in inputs given the images of training, except
+ * that the K nearest images vote using the rule vote (one of the VOTE_
+ * constants in knn.h).
+ *
+ * Instead of streaming the whole training set through the cache once per
+ * test image, the test images are taken a tile at a time and the training
+ * set is walked in blocks: every block is compared with all images of the
+ * tile (four at a time, sharing the loads of each training row) before
+ * moving on to the next one. Distances are abandoned as soon as they cannot
+ * get into the K nearest, comparing the pixel blocks in the block_order of
+ * training (see order_blocks_by_variance). Each test image still
+ * sees the training images in index order, so its K nearest images are
+ * exactly those found by knn_predict.
+ */
+void knn_predict_batch(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                       ImageSet *training, int vote, int *predictions) {
+    Neighbour *items = new_batch_heaps(K);
+    predict_batch(inputs, num_inputs, K, training, vote, predictions, items);
+    free(items);
+}
 
-                    double arr[K][2];
-                    unsigned char label_arr[K];
-                    double max_dist = 0;
-                    int max_index = 0;
-
-                    for (int i = 0; i < training_size; i++) {
-                        // adding K images to an array
-                        if (i < K) {
-                            arr[i][0] = (double) (int) labels[i];
-                            arr[i][1] = distance(input, dataset[i]);
-                        } else {
-                            // finding max distance index in K
-                            for (int j = 0; j < K; j++) {
-                                if (arr[j][1] > max_dist) {
-                                    max_dist = arr[j][1];
-                                    max_index = j;
-                                }
-                            }
-                            // comparing distance from dataset to the biggest distance in K
-                            if (distance(input, dataset[i]) < max_dist) {
-                                arr[max_index][0] = (double) (int) labels[i];
-                                arr[max_index][1] = distance(input, dataset[i]);
-                            }
-                            max_dist = 0;
-                            max_index = 0;
-                        }
+/* knn_predict_batch with the heaps of a tile in items (see
+ * new_batch_heaps), so that callers that classify many tiles, like the
+ * threads of knn_predict_parallel, allocate them once.
+ */
+static void predict_batch(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                          ImageSet *training, int vote, int *predictions, Neighbour *items) {
+    unsigned char (*dataset)[NUM_PIXELS] = training->images;
+    int training_size = training->num_items;
+    TopK nearest[BATCH_QUERIES];
+
+    for (int first = 0; first < num_inputs; first += BATCH_QUERIES) {
+        int tile = num_inputs - first < BATCH_QUERIES ? num_inputs - first : BATCH_QUERIES;
+        for (int q = 0; q < tile; q++) {
+            nearest[q] = (TopK){items + q * K, 0, K};
+        }
+
+        for (int start = 0; start < training_size; start += BATCH_ROWS) {
+            int stop = start + BATCH_ROWS < training_size ? start + BATCH_ROWS : training_size;
+            int q = 0;
+            for (; q + 4 <= tile; q += 4) {
+                unsigned char *quad[4] = {inputs[first + q], inputs[first + q + 1],
+                                          inputs[first + q + 2], inputs[first + q + 3]};
+                for (int i = start; i < stop; i++) {
+                    unsigned int bounds[4], dist[4];
+                    for (int j = 0; j < 4; j++) {
+                        bounds[j] = topk_bound(&nearest[q + j]);
                     }
-                    for (int i = 0; i < K; i++) {
-                        label_arr[i] = (int) arr[i][0];
+                    distance_sq_x4_bounded_impl(quad, dataset[i], bounds, dist,
+                                                training->block_order);
+                    for (int j = 0; j < 4; j++) {
+                        topk_offer(&nearest[q + j], dist[j], i);
                     }
-                    return mode(label_arr, K);
-                }
\ No newline at end of file
+                }
+            }
+            for (; q < tile; q++) {
+                for (int i = start; i < stop; i++) {
+                    unsigned int bound = topk_bound(&nearest[q]);
+                    topk_offer(&nearest[q],
+                               distance_sq_bounded_impl(inputs[first + q], dataset[i], bound,
+                                                        training->block_order), i);
+                }
+            }
+        }
+
+        for (int q = 0; q < tile; q++) {
+            predictions[first + q] = topk_vote(&nearest[q], training->labels, vote);
+        }
+    }
+}
+
+/* Number of binarized training images that knn_predict_hamming compares
+ * with a tile of test images at a time (about 100KB, like BATCH_ROWS).
+ */
+#define HAMMING_ROWS 1024
+
+/**
+ * Same as knn_predict_batch, but for the binarized images (see
+ * binarize_image_set) inputs and dataset, using the hamming distance.
+ * With VOTE_DISTANCE an image at hamming distance h gets 1/sqrt(h) votes,
+ * since h is a squared euclidean distance (see distance_hamming).
+ */
+void knn_predict_hamming(unsigned long long inputs[][BIT_WORDS], int num_inputs, int K,
+                         unsigned long long dataset[][BIT_WORDS],
+                         unsigned char *labels, int training_size,
+                         int vote, int *predictions) {
+    Neighbour *items = new_batch_heaps(K);
+    predict_hamming(inputs, num_inputs, K, dataset, labels, training_size, vote, predictions,
+                    items);
+    free(items);
+}
+
+/* knn_predict_hamming with the heaps of a tile in items, like
+ * predict_batch.
+ */
+static void predict_hamming(unsigned long long inputs[][BIT_WORDS], int num_inputs, int K,
+                            unsigned long long dataset[][BIT_WORDS], unsigned char *labels,
+                            int training_size, int vote, int *predictions, Neighbour *items) {
+    TopK nearest[BATCH_QUERIES];
+
+    for (int first = 0; first < num_inputs; first += BATCH_QUERIES) {
+        int tile = num_inputs - first < BATCH_QUERIES ? num_inputs - first : BATCH_QUERIES;
+        for (int q = 0; q < tile; q++) {
+            nearest[q] = (TopK){items + q * K, 0, K};
+        }
+        for (int start = 0; start < training_size; start += HAMMING_ROWS) {
+            int stop = start + HAMMING_ROWS < training_size ? start + HAMMING_ROWS : training_size;
+            for (int q = 0; q < tile; q++) {
+                for (int i = start; i < stop; i++) {
+                    unsigned int dist = distance_hamming_impl(inputs[first + q], dataset[i]);
+                    if (dist < topk_bound(&nearest[q])) {
+                        topk_offer(&nearest[q], dist, i);
+                    }
+                }
+            }
+        }
+        for (int q = 0; q < tile; q++) {
+            predictions[first + q] = topk_vote(&nearest[q], labels, vote);
+        }
+    }
+}
+
+/* The test image tiles still to be classified by one thread of
+ * knn_predict_parallel. The owner takes tiles from the front; a thread
+ * that has run out of work steals the back half of another thread's range.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int next;  // first tile not yet taken
+    int end;   // one past the last tile
+} TileQueue;
+
+/* Everything a thread of knn_predict_parallel needs.
+ */
+typedef struct {
+    int id;
+    int num_threads;
+    TileQueue *queues;
+    unsigned char (*inputs)[NUM_PIXELS];
+    int num_inputs;
+    int K;
+    int vote;
+    ImageSet *training;
+    int vptree;                                     // 1 to search its vptree
+    unsigned long long (*input_bits)[BIT_WORDS];    // Set to use the hamming
+    unsigned long long (*dataset_bits)[BIT_WORDS];  // distance instead
+    unsigned char *labels;
+    int training_size;
+    int *predictions;
+    ThreadStats *stats;
+} PredictWorker;
+
+/* Take the next tile from queue, or return -1 if it is empty.
+ */
+static int take_tile(TileQueue *queue) {
+    int tile = -1;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->next < queue->end) {
+        tile = queue->next++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return tile;
+}
+
+/* Move the back half of some other thread's remaining tiles into the queue
+ * of worker w. Return 0 if every other queue is empty.
+ */
+static int steal_tiles(PredictWorker *w) {
+    for (int k = 1; k < w->num_threads; k++) {
+        TileQueue *victim = &w->queues[(w->id + k) % w->num_threads];
+        pthread_mutex_lock(&victim->lock);
+        int remaining = victim->end - victim->next;
+        int count = (remaining + 1) / 2;
+        victim->end -= count;
+        int stolen = victim->end;  // Read under the lock: others may change it after
+        pthread_mutex_unlock(&victim->lock);
+        if (count > 0) {
+            TileQueue *own = &w->queues[w->id];
+            pthread_mutex_lock(&own->lock);
+            own->next = stolen;
+            own->end = stolen + count;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *predict_worker(void *arg) {
+    PredictWorker *w = arg;
+    Neighbour *items = new_batch_heaps(w->K);
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        int tile = take_tile(&w->queues[w->id]);
+        if (tile == -1) {
+            if (!steal_tiles(w)) {
+                break;
+            }
+            w->stats->steals++;
+            continue;
+        }
+        int first = tile * BATCH_QUERIES;
+        int count = w->num_inputs - first < BATCH_QUERIES ? w->num_inputs - first : BATCH_QUERIES;
+        if (w->vptree) {
+            knn_predict_vptree(w->inputs + first, count, w->K, w->training, w->vote,
+                               w->predictions + first);
+        } else if (w->dataset_bits != NULL) {
+            predict_hamming(w->input_bits + first, count, w->K, w->dataset_bits, w->labels,
+                            w->training_size, w->vote, w->predictions + first, items);
+        } else {
+            predict_batch(w->inputs + first, count, w->K, w->training, w->vote,
+                          w->predictions + first, items);
+        }
+        w->stats->images += count;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    w->stats->seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    free(items);
+    return NULL;
+}
+
+/* Run the workers of knn_predict_parallel, knn_predict_parallel_hamming or
+ * knn_predict_parallel_vptree with num_threads threads. job holds everything but the per thread
+ * fields.
+ */
+static void run_predict_workers(PredictWorker job, int num_threads, ThreadStats *stats) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    int num_tiles = (job.num_inputs + BATCH_QUERIES - 1) / BATCH_QUERIES;
+    TileQueue queues[num_threads];
+    PredictWorker workers[num_threads];
+    ThreadStats local_stats[num_threads];
+    pthread_t threads[num_threads];
+
+    for (int t = 0; t < num_threads; t++) {
+        pthread_mutex_init(&queues[t].lock, NULL);
+        queues[t].next = (long)num_tiles * t / num_threads;
+        queues[t].end = (long)num_tiles * (t + 1) / num_threads;
+        local_stats[t] = (ThreadStats){0, 0, 0};
+        workers[t] = job;
+        workers[t].id = t;
+        workers[t].num_threads = num_threads;
+        workers[t].queues = queues;
+        workers[t].stats = &local_stats[t];
+    }
+    for (int t = 1; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, predict_worker, &workers[t]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    predict_worker(&workers[0]);
+    for (int t = 1; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        pthread_mutex_destroy(&queues[t].lock);
+        if (stats != NULL) {
+            stats[t] = local_stats[t];
+        }
+    }
+}
+
+/**
+ * Same as knn_predict_batch, but the test images are classified by
+ * num_threads threads that share the (read-only) training set.
+ *
+ * The test images are split into tiles that are dealt out evenly to the
+ * threads up front; a thread that finishes early steals half of the
+ * remaining tiles of another thread. Every prediction is written to its
+ * own slot, so the result is identical to knn_predict_batch.
+ *
+ * If stats is not NULL, stats[t] is filled in with the number of images
+ * thread t classified, how long it ran and how many times it stole work.
+ */
+void knn_predict_parallel(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                          ImageSet *training, int vote, int *predictions,
+                          int num_threads, ThreadStats *stats) {
+    PredictWorker job = {.inputs = inputs, .num_inputs = num_inputs, .K = K, .vote = vote,
+                         .training = training, .predictions = predictions};
+    run_predict_workers(job, num_threads, stats);
+}
+
+/**
+ * Same as knn_predict_parallel, but for binarized images, with the result
+ * of knn_predict_hamming.
+ */
+void knn_predict_parallel_hamming(unsigned long long inputs[][BIT_WORDS], int num_inputs,
+                                  int K, unsigned long long dataset[][BIT_WORDS],
+                                  unsigned char *labels, int training_size, int vote,
+                                  int *predictions, int num_threads, ThreadStats *stats) {
+    PredictWorker job = {.input_bits = inputs, .num_inputs = num_inputs, .K = K,
+                         .vote = vote, .dataset_bits = dataset, .labels = labels,
+                         .training_size = training_size, .predictions = predictions};
+    run_predict_workers(job, num_threads, stats);
+}
+
+/* An exact vantage-point tree over the images of an ImageSet, for the
+ * euclidean distance. Each inner node has a vantage point image vp: the
+ * images below it at most radius from vp are under inside, the others (at
+ * least radius away) under outside. By the triangle inequality a test
+ * image at distance d from vp is at least d - radius from everything
+ * inside and at least radius - d from everything outside, so a whole
+ * subtree can be skipped when that is further than the worst of the K
+ * nearest so far. Small subtrees are leaves that list their images.
+ *
+ * The nodes and the leaf lists are flat arrays so the tree can be saved to
+ * disk as is.
+ */
+#define VP_LEAF_SIZE 8
+
+/* The radii and distances are rounded square roots, so the triangle
+ * inequality may be off by a few units in the last place; a subtree is
+ * only skipped if it is further away than this (relative) margin too.
+ */
+#define VP_SLACK 1e-9
+
+typedef struct {
+    int vp;         // Vantage point image, or -1 for a leaf
+    double radius;  // Median distance from vp of the images below
+    int inside;     // Node of the images within radius of vp, or -1
+    int outside;    // Node of the images at least radius from vp, or -1
+    int first;      // Leaf: its images are items[first] .. items[first + count - 1]
+    int count;
+} VpNode;
+
+struct VpTree {
+    int num_nodes;
+    VpNode *nodes;
+    int num_items;
+    int *items;     // Every image, leaf lists in order
+};
+
+typedef struct {
+    unsigned int key;
+    int index;
+} VpKey;
+
+static int vp_key_compare(const void *a, const void *b) {
+    const VpKey *x = a, *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+/* Build the subtree over the images items[lo] .. items[hi - 1] of dataset
+ * (reordering them) and return its node.
+ */
+static int vptree_build_node(struct VpTree *tree, unsigned char dataset[][NUM_PIXELS],
+                             int lo, int hi, VpKey *keys, unsigned int *seed) {
+    int id = tree->num_nodes++;
+    int n = hi - lo;
+    if (n <= VP_LEAF_SIZE) {
+        tree->nodes[id] = (VpNode){-1, 0, -1, -1, lo, n};
+        return id;
+    }
+
+    // Move a random vantage point to the front and sort the rest by their
+    // distance from it
+    int pick = lo + rand_r(seed) % n;
+    int vp = tree->items[pick];
+    tree->items[pick] = tree->items[lo];
+    tree->items[lo] = vp;
+    for (int i = lo + 1; i < hi; i++) {
+        keys[i - lo - 1] = (VpKey){distance_sq(dataset[tree->items[i]], dataset[vp]),
+                                   tree->items[i]};
+    }
+    qsort(keys, n - 1, sizeof(VpKey), vp_key_compare);
+    for (int i = lo + 1; i < hi; i++) {
+        tree->items[i] = keys[i - lo - 1].index;
+    }
+    int mid = lo + 1 + (n - 1) / 2;
+    double radius = sqrt(keys[(n - 1) / 2 - 1].key);
+
+    int inside = vptree_build_node(tree, dataset, lo + 1, mid, keys, seed);
+    int outside = vptree_build_node(tree, dataset, mid, hi, keys, seed);
+    tree->nodes[id] = (VpNode){vp, radius, inside, outside, 0, 0};
+    return id;
+}
+
+/**
+ * Build a vantage-point tree over the images of set for the euclidean
+ * distance and attach it to set (replacing any earlier one). See
+ * knn_predict_vptree.
+ */
+void build_vptree(ImageSet *set) {
+    free_vptree(set);
+    int n = set->num_items;
+    struct VpTree *tree = malloc(sizeof(struct VpTree));
+    VpKey *keys = malloc(sizeof(VpKey) * (n > 0 ? n : 1));
+    if (tree == NULL || keys == NULL ||
+            (tree->nodes = malloc(sizeof(VpNode) * (n > 0 ? n : 1))) == NULL ||
+            (tree->items = malloc(sizeof(int) * (n > 0 ? n : 1))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    tree->num_nodes = 0;
+    tree->num_items = n;
+    for (int i = 0; i < n; i++) {
+        tree->items[i] = i;
+    }
+    unsigned int seed = 209;
+    vptree_build_node(tree, set->images, 0, n, keys, &seed);
+    free(keys);
+    set->vptree = tree;
+}
+
+/**
+ * Free the vantage-point tree attached to set, if any.
+ */
+void free_vptree(ImageSet *set) {
+    if (set->vptree == NULL) {
+        return;
+    }
+    free(set->vptree->nodes);
+    free(set->vptree->items);
+    free(set->vptree);
+    set->vptree = NULL;
+}
+
+/* A saved tree is keyed like the image cache (see list_key), so it is only
+ * used while the list and the listed images are unchanged.
+ */
+#define VPTREE_MAGIC 0x31545056  // "VPT1"
+
+typedef struct {
+    unsigned int magic;
+    int num_items;
+    int num_nodes;
+    unsigned long long key;
+} VpHeader;
+
+/* Read the tree saved at path if it was saved for n images with the given
+ * key and is well formed. Return it, or NULL.
+ */
+static struct VpTree *load_vptree(char *path, unsigned long long key, int n) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    VpHeader h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 && h.magic == VPTREE_MAGIC &&
+             h.num_items == n && h.key == key &&
+             h.num_nodes > 0 && h.num_nodes <= (n > 0 ? n : 1);
+    struct VpTree *tree = malloc(sizeof(struct VpTree));
+    if (tree == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    tree->nodes = NULL;
+    tree->items = NULL;
+    if (ok) {
+        tree->num_nodes = h.num_nodes;
+        tree->num_items = n;
+        tree->nodes = malloc(sizeof(VpNode) * h.num_nodes);
+        tree->items = malloc(sizeof(int) * (n > 0 ? n : 1));
+        ok = tree->nodes != NULL && tree->items != NULL &&
+             fread(tree->nodes, sizeof(VpNode), h.num_nodes, f) == (size_t)h.num_nodes &&
+             fread(tree->items, sizeof(int), n, f) == (size_t)n;
+    }
+    // Children always come after their parent, so a valid tree has no loops
+    for (int i = 0; ok && i < h.num_nodes; i++) {
+        VpNode *node = &tree->nodes[i];
+        ok = node->vp >= -1 && node->vp < n &&
+             (node->inside == -1 || (node->inside > i && node->inside < h.num_nodes)) &&
+             (node->outside == -1 || (node->outside > i && node->outside < h.num_nodes)) &&
+             node->first >= 0 && node->count >= 0 && node->first <= n - node->count;
+    }
+    for (int i = 0; ok && i < n; i++) {
+        ok = tree->items[i] >= 0 && tree->items[i] < n;
+    }
+    fclose(f);
+    if (!ok) {
+        free(tree->nodes);
+        free(tree->items);
+        free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+/* Write tree to path, like save_cache.
+ */
+static void save_vptree(char *path, unsigned long long key, struct VpTree *tree) {
+    char tmp[strlen(path) + 16];
+    sprintf(tmp, "%s.%d", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        return;
+    }
+    VpHeader h = {VPTREE_MAGIC, tree->num_items, tree->num_nodes, key};
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(tree->nodes, sizeof(VpNode), tree->num_nodes, f) == (size_t)tree->num_nodes &&
+             fwrite(tree->items, sizeof(int), tree->num_items, f) == (size_t)tree->num_items;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+    }
+}
+
+/**
+ * Attach a vantage-point tree to set, which was loaded from the list file
+ * filename. The tree is read from "<filename>.vpt" if it was saved there
+ * for the same list of unchanged images; otherwise it is built with
+ * build_vptree and saved there for the next run. Return 1 if the tree was
+ * read from disk.
+ */
+int attach_vptree(ImageSet *set, char *filename) {
+    char (*names)[MAX_NAME + 1];
+    int n = read_list(filename, &names);
+    unsigned long long key = list_key(names, n);
+    free(names);
+    char path[strlen(filename) + 8];
+    sprintf(path, "%s.vpt", filename);
+
+    struct VpTree *tree = n == set->num_items ? load_vptree(path, key, n) : NULL;
+    if (tree != NULL) {
+        free_vptree(set);
+        set->vptree = tree;
+        return 1;
+    }
+    build_vptree(set);
+    save_vptree(path, key, set->vptree);
+    return 0;
+}
+
+/* Offer image index at distance dist to the heap (of at least one image)
+ * like topk_offer, keeping in *tied the number of images offered so far
+ * that are not in the heap but are as near as the worst one in it.
+ */
+static void vptree_offer(TopK *h, unsigned int dist, int index, int *tied) {
+    if (h->size < h->capacity) {
+        topk_offer(h, dist, index);
+        return;
+    }
+    unsigned int worst = h->items[0].dist;
+    if (dist == worst) {
+        (*tied)++;
+    } else if (dist < worst) {
+        // The image put out is tied with the new worst one if that is just
+        // as far, and the earlier ties with it are too; if not, none are
+        topk_offer(h, dist, index);
+        *tied = h->items[0].dist == worst ? *tied + 1 : 0;
+    }
+}
+
+/* Offer every image in the subtree under node that could be one of the K
+ * nearest to input to the heap, counting in *tied those left out of it at
+ * the K-th distance (see vptree_offer). Images are offered out of index
+ * order, so if any are the heap may keep different ones of the tied
+ * images than the scan does; if none are, it holds the same K images.
+ */
+static void vptree_search(struct VpTree *tree, int id, unsigned char *input,
+                          ImageSet *training, TopK *nearest, int *tied) {
+    VpNode *node = &tree->nodes[id];
+    if (node->vp == -1) {
+        for (int i = node->first; i < node->first + node->count; i++) {
+            int index = tree->items[i];
+            // Only abandon distances beyond the worst, so ties are seen
+            unsigned int bound = topk_bound(nearest);
+            bound = bound == UINT_MAX ? bound : bound + 1;
+            unsigned int dist = distance_sq_bounded_impl(input, training->images[index], bound,
+                                                         training->block_order);
+            if (dist < bound) {
+                vptree_offer(nearest, dist, index, tied);
+            }
+        }
+        return;
+    }
+
+    unsigned int dist = distance_sq(input, training->images[node->vp]);
+    vptree_offer(nearest, dist, node->vp, tied);
+    double d = sqrt(dist);
+
+    // Search the side the input is on first, as it tightens the bound most
+    int near = d <= node->radius ? node->inside : node->outside;
+    int far = d <= node->radius ? node->outside : node->inside;
+    for (int side = 0; side < 2; side++) {
+        int child = side == 0 ? near : far;
+        if (child == -1) {
+            continue;
+        }
+        // Everything in a subtree skipped is further than the worst, so no
+        // ties are missed
+        double gap = child == node->inside ? d - node->radius : node->radius - d;
+        unsigned int bound = topk_bound(nearest);
+        if (bound != UINT_MAX && gap - sqrt(bound) > VP_SLACK * (1 + d + node->radius)) {
+            continue;
+        }
+        vptree_search(tree, child, input, training, nearest, tied);
+    }
+}
+
+/**
+ * Same as knn_predict_batch, but the K nearest images to each input are
+ * found by searching the vantage-point tree attached to the training set
+ * (see build_vptree) rather than every image. The K nearest images, and so
+ * the predictions, are the same: an input for which the search finds
+ * images tied for the K-th distance left out of the K, where which of them
+ * are kept depends on the order they are seen in, is compared with every
+ * image in index order instead.
+ */
+void knn_predict_vptree(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                        ImageSet *training, int vote, int *predictions) {
+    Neighbour items[K > 0 ? K : 1];
+    for (int q = 0; q < num_inputs; q++) {
+        TopK nearest = {items, 0, K};
+        int tied = 0;
+        if (K > 0) {
+            vptree_search(training->vptree, 0, inputs[q], training, &nearest, &tied);
+        }
+        if (tied > 0) {
+            nearest.size = 0;
+            for (int i = 0; i < training->num_items; i++) {
+                unsigned int bound = topk_bound(&nearest);
+                topk_offer(&nearest, distance_sq_bounded_impl(inputs[q], training->images[i], bound,
+                                                              training->block_order), i);
+            }
+        }
+        predictions[q] = topk_vote(&nearest, training->labels, vote);
+    }
+}
+
+/**
+ * Same as knn_predict_parallel, but with the result of knn_predict_vptree.
+ */
+void knn_predict_parallel_vptree(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                                 ImageSet *training, int vote, int *predictions,
+                                 int num_threads, ThreadStats *stats) {
+    PredictWorker job = {.inputs = inputs, .num_inputs = num_inputs, .K = K, .vote = vote,
+                         .training = training, .vptree = 1, .predictions = predictions};
+    run_predict_workers(job, num_threads, stats);
+}
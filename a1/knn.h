@@ -26,6 +26,55 @@
  */
 #define MAX_NAME 128
 
+/* The labels are the digits 0-9 */
+#define NUM_LABELS 10
+
+/* Number of 64-bit words in a binarized image, which has one bit per pixel
+ * that is set if the pixel is at least BIT_THRESHOLD */
+#define BIT_WORDS (((NUM_PIXELS) + 63) / 64)
+#define BIT_THRESHOLD 128
+
+/* The bounded distances compare the pixels one block (a cache line of
+ * BLOCK_PIXELS pixels) at a time (see order_blocks_by_variance) */
+#define BLOCK_PIXELS 64
+#define NUM_BLOCKS (((NUM_PIXELS) + BLOCK_PIXELS - 1) / BLOCK_PIXELS)
+
+/* How the K nearest images vote for a label in knn_predict_batch and
+ * knn_predict_parallel:
+ *    VOTE_MAJORITY - every image gets one vote (what knn_predict does)
+ *    VOTE_DISTANCE - an image at distance d gets 1/d votes; if any image is
+ *                    an exact match, only the exact matches vote
+ *    VOTE_RANK     - the nearest image gets K votes, the next K - 1, ...
+ * In every case a tie goes to the smallest label.
+ */
+#define VOTE_MAJORITY 0
+#define VOTE_DISTANCE 1
+#define VOTE_RANK 2
+
+/* An index over the images of an ImageSet (see build_vptree) */
+struct VpTree;
+
+/* A set of images loaded from a list file by load_image_set. The pixels
+ * of all the images are one contiguous, cache line aligned allocation of
+ * exactly num_items rows.
+ */
+typedef struct {
+    int num_items;                        // Number of images in the set
+    unsigned char (*images)[NUM_PIXELS];  // Row i holds the pixels of image i
+    unsigned char *labels;                // Label of each image
+    unsigned long long (*bits)[BIT_WORDS];  // Binarized rows, or NULL
+    struct VpTree *vptree;                // Index over the images, or NULL
+    int block_order[NUM_BLOCKS];          // Order distances to the images compare blocks in
+} ImageSet;
+
+/* Work done by one thread of knn_predict_parallel.
+ */
+typedef struct {
+    int images;      // Number of test images the thread classified
+    int steals;      // Number of times it took work from another thread
+    double seconds;  // Wall clock time the thread ran for
+} ThreadStats;
+
 /* These functions are defined in knn.c  Their prototypes are included
  * here so that we don't have to write out the definitions for these
  * functions in the files that use them (e.g. classifier.c)
@@ -33,12 +82,44 @@
 void load_image(char *filename, unsigned char *img);
 
 void print_image(unsigned char *img);
+void usage(char *name);
 
 int load_dataset(char *filename,
                  unsigned char dataset[MAX_SIZE][NUM_PIXELS],
                  unsigned char *labels);
+int load_dataset_parallel(char *filename,
+                          unsigned char dataset[MAX_SIZE][NUM_PIXELS],
+                          unsigned char *labels, int num_threads);
+ImageSet *load_image_set(char *filename, int num_threads);
+void free_image_set(ImageSet *set);
+void binarize_image_set(ImageSet *set);
+void build_vptree(ImageSet *set);
+int attach_vptree(ImageSet *set, char *filename);
+void free_vptree(ImageSet *set);
+unsigned int distance_sq(unsigned char *a, unsigned char *b);
 double distance(unsigned char *a, unsigned char *b);
+unsigned int distance_sq_bounded(unsigned char *a, unsigned char *b, unsigned int bound);
+void order_blocks_by_variance(ImageSet *set);
+unsigned int distance_hamming(unsigned long long *a, unsigned long long *b);
 
 int knn_predict(unsigned char *input, int K,
                 unsigned char dataset[MAX_SIZE][NUM_PIXELS],
                 unsigned char *labels, int training_size);
+void knn_predict_batch(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                       ImageSet *training, int vote, int *predictions);
+void knn_predict_parallel(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                          ImageSet *training, int vote, int *predictions,
+                          int num_threads, ThreadStats *stats);
+void knn_predict_hamming(unsigned long long inputs[][BIT_WORDS], int num_inputs, int K,
+                         unsigned long long dataset[][BIT_WORDS],
+                         unsigned char *labels, int training_size,
+                         int vote, int *predictions);
+void knn_predict_parallel_hamming(unsigned long long inputs[][BIT_WORDS], int num_inputs,
+                                  int K, unsigned long long dataset[][BIT_WORDS],
+                                  unsigned char *labels, int training_size, int vote,
+                                  int *predictions, int num_threads, ThreadStats *stats);
+void knn_predict_vptree(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                        ImageSet *training, int vote, int *predictions);
+void knn_predict_parallel_vptree(unsigned char inputs[][NUM_PIXELS], int num_inputs, int K,
+                                 ImageSet *training, int vote, int *predictions,
+                                 int num_threads, ThreadStats *stats);
@@ -20,6 +20,7 @@
 //
 // Running decision tree generation / validation:
 //    ./classifier datasets/training_data.bin datasets/testing_data.bin
+//    ./classifier datasets/training_data.bin datasets/testing_data.bin slab
 
 /*****************************************************************************/
 /* Do not add anything outside the main function here. Any core logic other  */
@@ -30,6 +31,8 @@
  * main() takes in 2 command line arguments:
  *    - training_data: A binary file containing training image / label data
  *    - testing_data: A binary file containing testing image / label data
+ * and optionally a third, `slab`, to load the data sets into aligned slabs
+ * (load_dataset_slab) rather than mapping them.
  *
  * You need to do the following:
  *    - Parse the command line arguments, call `load_dataset()` appropriately.
@@ -45,8 +48,12 @@ int main(int argc, char *argv[]) {
   int total_correct = 0;
 
   // TODO
-  Dataset *training = load_dataset(argv[1]);
-  Dataset *testing = load_dataset(argv[2]);
+  Dataset *(*load)(const char *) = load_dataset;
+  if (argc > 3 && strcmp(argv[3], "slab") == 0) {
+    load = load_dataset_slab;
+  }
+  Dataset *training = load(argv[1]);
+  Dataset *testing = load(argv[2]);
   DTNode *tree = build_dec_tree(training);
 
   for (int i = 0; i < testing->num_items; i++) {
@@ -12,8 +12,77 @@
  * Copyright (c) 2021 Karen Reid
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "dectree.h"
 
+/* Size of one label + image record in the dataset files */
+#define RECORD_SIZE (1 + NUM_PIXELS)
+
+/* Length of the mapping of a dataset file holding num_items images */
+static size_t mapping_size(int num_items) {
+    return sizeof(int) + (size_t)num_items * RECORD_SIZE;
+}
+
+/* Map the dataset file filename read-only, storing the number of images in
+ * *num_items and the length of the mapping in *size.
+ */
+static unsigned char *map_dataset_file(const char *filename, int *num_items, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    if (read(fd, num_items, sizeof(int)) != sizeof(int)) {
+        fprintf(stderr, "Could not read num items from %s\n", filename);
+        exit(1);
+    }
+    *size = mapping_size(*num_items);
+    if (*num_items < 0 || (size_t)st.st_size < *size) {
+        fprintf(stderr, "Error: %s is too short for %d images\n", filename, *num_items);
+        exit(1);
+    }
+
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    unsigned char *map = mmap(NULL, *size, PROT_READ, flags, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (madvise(map, *size, MADV_WILLNEED) == -1) {
+        perror("madvise");
+    }
+    close(fd);
+    return map;
+}
+
+/* Allocate a Dataset of num_items images whose pixels are yet to be set.
+ */
+static Dataset *new_dataset(int num_items) {
+    Dataset *data = malloc(sizeof(Dataset));
+    data->num_items = num_items;
+    data->images = malloc(sizeof(Image) * num_items);
+    data->labels = malloc(sizeof(unsigned char) * num_items);
+    data->slab = NULL;
+    data->map = NULL;
+    data->map_size = 0;
+    for (int i = 0; i < num_items; i++) {
+        data->images[i].sx = WIDTH;
+        data->images[i].sy = WIDTH;
+    }
+    return data;
+}
+
 /**
  * Load the binary file, filename into a Dataset and return a pointer to 
  * the Dataset. The binary file format is as follows:
@@ -27,31 +96,54 @@
  *
  * You can set the `sx` and `sy` values for all the images to WIDTH. 
  * Use the NUM_PIXELS and WIDTH constants defined in dectree.h
+ *
+ * The file is memory-mapped, and each image's data points at its pixels
+ * inside the mapping, so the pixels must not be modified.
  */
 Dataset *load_dataset(const char *filename) {
-    // TODO: Allocate data, read image data / labels, return
-    Dataset *data = malloc(sizeof(Dataset));
-    
-    FILE *fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        perror("fopen");
-        exit(1);
-    }
+    int num_items;
+    size_t size;
+    unsigned char *map = map_dataset_file(filename, &num_items, &size);
+    Dataset *data = new_dataset(num_items);
+    data->map = map;
+    data->map_size = size;
 
-    fread(&data->num_items, sizeof(int), 1, fp);
-    data->images = malloc(sizeof(Image) * data->num_items);
-    data->labels = malloc(sizeof(unsigned char) * data->num_items);
+    // Point the images straight into the mapping
+    unsigned char *record = map + sizeof(int);
+    for (int i = 0; i < num_items; i++, record += RECORD_SIZE) {
+        data->labels[i] = record[0];
+        data->images[i].data = record + 1;
+    }
+    return data;
+}
 
+/**
+ * Load the binary file filename, in the same format as for load_dataset,
+ * into a single SLAB_ALIGN-aligned slab of pixels instead: the pixels of
+ * image i are at dataset_pixels(data, i) == data->slab + i * SLAB_STRIDE.
+ * Each image's data also points at its row, so everything that works on a
+ * Dataset works on either layout.
+ */
+Dataset *load_dataset_slab(const char *filename) {
+    int num_items;
+    size_t size;
+    unsigned char *map = map_dataset_file(filename, &num_items, &size);
+    Dataset *data = new_dataset(num_items);
 
-    for (int i = 0; i < data->num_items; i++) {
-        fread(&data->labels[i], sizeof(unsigned char), 1, fp);
-        data->images[i].data = malloc(sizeof(unsigned char) * NUM_PIXELS);
-        data->images[i].sx = WIDTH;
-        data->images[i].sy = WIDTH;
-        fread((data->images)[i].data, sizeof(unsigned char), NUM_PIXELS, fp);
+    size_t slab_size = (size_t)num_items * SLAB_STRIDE;
+    if (posix_memalign((void **)&data->slab, SLAB_ALIGN, slab_size > 0 ? slab_size : SLAB_ALIGN) != 0) {
+        fprintf(stderr, "Could not allocate the pixels of %s\n", filename);
+        exit(1);
     }
-
-    fclose(fp);
+    unsigned char *record = map + sizeof(int);
+    for (int i = 0; i < num_items; i++, record += RECORD_SIZE) {
+        unsigned char *row = data->slab + (size_t)i * SLAB_STRIDE;
+        data->labels[i] = record[0];
+        memcpy(row, record + 1, NUM_PIXELS);
+        memset(row + NUM_PIXELS, 0, SLAB_STRIDE - NUM_PIXELS);
+        data->images[i].data = row;
+    }
+    munmap(map, size);
     return data;
 }
 
@@ -77,7 +169,7 @@ double gini_impurity(Dataset *data, int M, int *indices, int pixel) {
         int img_idx = indices[i];
 
         // The pixels are always either 0 or 255, but using < 128 for generality.
-        if (data->images[img_idx].data[pixel] < 128) {
+        if (dataset_pixels(data, img_idx)[pixel] < 128) {
             a_freq[data->labels[img_idx]]++;
             a_count++;
         } else {
@@ -203,9 +295,7 @@ DTNode *build_subtree(Dataset *data, int M, int *indices) {
         int bCount = 0;
 
         for (int i = 0; i < M; i++) {
-            Image img = data->images[i];
-
-            if (img.data[bestSplit] > 128) {
+            if (dataset_pixels(data, i)[bestSplit] > 128) {
                 wCount += 1;
             } else {
                 bCount += 1;
@@ -220,9 +310,7 @@ DTNode *build_subtree(Dataset *data, int M, int *indices) {
         int wCounter = 0;
         int bCounter = 0;
         for (int i = 0; i < M; i++) {
-            Image img = data->images[i];
-
-            if (img.data[bestSplit] > 128) {
+            if (dataset_pixels(data, i)[bestSplit] > 128) {
                 numWhite[wCounter] = indices[i];
                 wCounter += 1;
             } else {
@@ -286,7 +374,10 @@ void free_dec_tree(DTNode *node) {
  * Free all the allocated memory for the dataset
  */
 void free_dataset(Dataset *data) {
-    // TODO: Free dataset (Same as A1)
+    if (data->map != NULL && munmap(data->map, data->map_size) == -1) {
+        perror("munmap");
+    }
+    free(data->slab);
     free(data->images);
     free(data->labels);
     free(data);
@@ -50,6 +50,11 @@
 #define NUM_PIXELS WIDTH * WIDTH
 #endif
 
+/* Bytes between the rows of a slab (NUM_PIXELS rounded up to whole cache
+ * lines), and the alignment of the slab */
+#define SLAB_STRIDE 832
+#define SLAB_ALIGN 64
+
 /**
  * The following structs represent the dataset. These structs differ
  * from the representation of the data set the following ways:
@@ -72,8 +77,19 @@ typedef struct {
     int num_items;          // Number of images in the dataset
     Image *images;          // Array of `num_items` Image structs
     unsigned char *labels;  // Array of `num_items` labels [0-9]
+    unsigned char *slab;    // `num_items` rows of SLAB_STRIDE pixels, or NULL
+    void *map;              // The mapped dataset file the images point into, or NULL
+    size_t map_size;        // Length of the mapping in bytes
 } Dataset;
 
+/* Return the pixels of image i of data, from its slab if it has one */
+static inline unsigned char *dataset_pixels(Dataset *data, int i) {
+    if (data->slab != NULL) {
+        return data->slab + (size_t)i * SLAB_STRIDE;
+    }
+    return data->images[i].data;
+}
+
 
 /* The following struct represents a node in the decision tree. */
 typedef struct dt_node {
@@ -85,6 +101,7 @@ typedef struct dt_node {
 
 
 Dataset *load_dataset(const char *filename);
+Dataset *load_dataset_slab(const char *filename);
 
 void get_most_frequent(Dataset *data, int M, int *indices, int *label, int *freq);
 int find_best_split(Dataset *data, int M, int *indices);
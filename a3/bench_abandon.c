@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "knn.h"
+
+/* A benchmark of the early-abandoning euclidean search in knn_predict.
+ * For each K the test set is classified three times:
+ *   - computing every distance in full (through a wrapper around
+ *     distance_euclidean, which knn_predict does not specialise)
+ *   - abandoning distances early, visiting the pixels in image order
+ *   - abandoning distances early, visiting the highest variance pixels first
+ * and the time, the fraction of pixel comparisons skipped and the number of
+ * predictions that differ from the full computation (always 0) are printed.
+ *
+ *    make bench_abandon
+ *    ./bench_abandon datasets/training_1000.bin datasets/testing_1000.bin
+ */
+
+double euclidean_full(Image *a, Image *b) {
+    return distance_euclidean(a, b);
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Classify every image in testing, storing the predictions in predictions
+ * and returning the time taken. If skipped is not NULL, store in it the
+ * fraction of the pixel comparisons that were skipped.
+ */
+double run(Dataset *training, Dataset *testing, int K, double (*fptr)(Image *, Image *),
+           int *predictions, double *skipped) {
+    long long compared0, skipped0, compared1, skipped1;
+    knn_pixel_stats(&compared0, &skipped0);
+    double start = now();
+    for (int i = 0; i < testing->num_items; i++) {
+        predictions[i] = knn_predict(training, &testing->images[i], K, fptr);
+    }
+    double elapsed = now() - start;
+    knn_pixel_stats(&compared1, &skipped1);
+    if (skipped != NULL) {
+        long long c = compared1 - compared0, s = skipped1 - skipped0;
+        *skipped = c + s > 0 ? (double)s / (c + s) : 0;
+    }
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s training_data testing_data\n", argv[0]);
+        exit(1);
+    }
+    Dataset *training = load_dataset(argv[1]);
+    Dataset *testing = load_dataset(argv[2]);
+    if (training == NULL || testing == NULL) {
+        fprintf(stderr, "The data sets could not be loaded\n");
+        exit(1);
+    }
+    int *full = malloc(sizeof(int) * testing->num_items);
+    int *plain = malloc(sizeof(int) * testing->num_items);
+    int *ordered = malloc(sizeof(int) * testing->num_items);
+
+    int sweep[] = {1, 7, 50, 200};
+    int num_k = sizeof(sweep) / sizeof(sweep[0]);
+    double t_full[num_k], t_plain[num_k], t_ordered[num_k];
+    double skip_plain[num_k], skip_ordered[num_k];
+    int disagree[num_k];
+
+    // The blocks of training start out in image order
+    for (int s = 0; s < num_k; s++) {
+        t_full[s] = run(training, testing, sweep[s], euclidean_full, full, NULL);
+        t_plain[s] = run(training, testing, sweep[s], distance_euclidean, plain, &skip_plain[s]);
+        disagree[s] = 0;
+        for (int i = 0; i < testing->num_items; i++) {
+            disagree[s] += plain[i] != full[i];
+        }
+    }
+    order_blocks_by_variance(training);
+    for (int s = 0; s < num_k; s++) {
+        run(training, testing, sweep[s], euclidean_full, full, NULL);
+        t_ordered[s] = run(training, testing, sweep[s], distance_euclidean, ordered,
+                           &skip_ordered[s]);
+        for (int i = 0; i < testing->num_items; i++) {
+            disagree[s] += ordered[i] != full[i];
+        }
+    }
+
+    printf("%5s %10s %19s %19s %9s\n", "K", "full (s)", "abandon (s, skip)",
+           "variance (s, skip)", "disagree");
+    for (int s = 0; s < num_k; s++) {
+        printf("%5d %10.4f %9.4f %8.1f%% %9.4f %8.1f%% %9d\n", sweep[s], t_full[s], t_plain[s],
+               100 * skip_plain[s], t_ordered[s], 100 * skip_ordered[s], disagree[s]);
+    }
+
+    free(full);
+    free(plain);
+    free(ordered);
+    free_dataset(training);
+    free_dataset(testing);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "knn.h"
+
+/* A benchmark of the two backends of the classifier. For p = 1 to 64 it
+ * classifies the test set with p child processes (forked, storing their
+ * predictions in a shared result area) and with p pinned threads, printing
+ * the time each takes from the first fork or thread to the last exit or
+ * join (best of 3) and the number classified correctly. The largest p is
+ * 64, or the one given, which can be more than the open files allowed.
+ *
+ *    make bench_backend
+ *    ./bench_backend datasets/training_1000.bin datasets/testing_1000.bin [K [max_p]]
+ */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Classify testing with p child processes the way the classifier does,
+ * storing the number correct in *correct and returning the time taken.
+ */
+double run_processes(Dataset *training, Dataset *testing, int K, int p, int *correct) {
+    fflush(stdout);  // Or the children would print it again
+    double start = now();
+    struct WorkQueue *queue = new_work_queue(testing->num_items, p, 1);
+    struct ResultArea *results = new_result_area(testing->num_items);
+    for (int i = 0; i < p; i++) {
+        int result = fork();
+        if (result < 0) {
+            perror("fork");
+            exit(1);
+        } else if (result == 0) {
+            child_handler_queue(training, testing, K, distance_euclidean, queue, i, results);
+            exit(0);
+        }
+    }
+    *correct = wait_for_results(results, p, 0);
+    free_result_area(results);
+    free_work_queue(queue);
+    return now() - start;
+}
+
+/* The same with p threads. */
+double run_threads(Dataset *training, Dataset *testing, int K, int p, int *correct) {
+    double start = now();
+    struct WorkQueue *queue = new_work_queue(testing->num_items, p, 1);
+    struct ResultArea *results = new_result_area(testing->num_items);
+    struct Placement *placement = new_placement(training, 0);
+    *correct = classify_threads(training, testing, K, distance_euclidean, queue, results,
+                                placement, 0);
+    free_placement(placement);
+    free_result_area(results);
+    free_work_queue(queue);
+    return now() - start;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "Usage: %s training_data testing_data [K [max_p]]\n", argv[0]);
+        exit(1);
+    }
+    int K = argc >= 4 ? atoi(argv[3]) : 1;
+    int max_p = argc == 5 ? atoi(argv[4]) : 64;
+    Dataset *training = load_dataset(argv[1]);
+    Dataset *testing = load_dataset(argv[2]);
+    if (training == NULL || testing == NULL) {
+        fprintf(stderr, "The data sets could not be loaded\n");
+        exit(1);
+    }
+    order_blocks_by_variance(training);
+
+    printf("%4s %14s %12s %8s\n", "p", "processes (s)", "threads (s)", "correct");
+    for (int p = 1; p <= max_p; p *= 2) {
+        double best_processes = INFINITY, best_threads = INFINITY;
+        int correct_processes, correct_threads;
+        for (int rep = 0; rep < 3; rep++) {
+            double t = run_processes(training, testing, K, p, &correct_processes);
+            best_processes = t < best_processes ? t : best_processes;
+            t = run_threads(training, testing, K, p, &correct_threads);
+            best_threads = t < best_threads ? t : best_threads;
+        }
+        if (correct_processes != correct_threads) {
+            fprintf(stderr, "The backends disagree for p = %d\n", p);
+            exit(1);
+        }
+        printf("%4d %14.4f %12.4f %8d\n", p, best_processes, best_threads, correct_threads);
+    }
+
+    free_dataset(training);
+    free_dataset(testing);
+    return 0;
+}
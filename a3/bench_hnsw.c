@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "knn.h"
+
+/* A benchmark of the approximate hnsw index against the exact scan. For
+ * each metric, M and ef it builds the graph, then classifies the test set
+ * by searching it, printing the time taken by both, the number of test
+ * images classified per second, the number classified correctly and the
+ * number of predictions that differ from the exact scan's.
+ *
+ *    make bench_hnsw
+ *    ./bench_hnsw datasets/training_1000.bin datasets/testing_1000.bin [K]
+ */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Classify every image in testing, storing the predictions in predictions
+ * and returning the time taken.
+ */
+double run(Dataset *training, Dataset *testing, int K, double (*fptr)(Image *, Image *),
+           int *predictions) {
+    double start = now();
+    for (int i = 0; i < testing->num_items; i++) {
+        predictions[i] = knn_predict(training, &testing->images[i], K, fptr);
+    }
+    return now() - start;
+}
+
+/* Print one row of the table for the predictions, taking t seconds.
+ */
+void report(const char *name, double t_build, double t, Dataset *testing, int *predictions,
+            int *exact) {
+    int correct = 0, disagree = 0;
+    for (int i = 0; i < testing->num_items; i++) {
+        correct += predictions[i] == testing->labels[i];
+        disagree += predictions[i] != exact[i];
+    }
+    printf("%-14s %10.4f %10.4f %10.0f %8d %9d\n", name, t_build, t, testing->num_items / t,
+           correct, disagree);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s training_data testing_data [K]\n", argv[0]);
+        exit(1);
+    }
+    int K = argc == 4 ? atoi(argv[3]) : 1;
+    Dataset *training = load_dataset(argv[1]);
+    Dataset *testing = load_dataset(argv[2]);
+    if (training == NULL || testing == NULL) {
+        fprintf(stderr, "The data sets could not be loaded\n");
+        exit(1);
+    }
+    binarize_dataset(training);
+    binarize_dataset(testing);
+    int *exact = malloc(sizeof(int) * testing->num_items);
+    int *approx = malloc(sizeof(int) * testing->num_items);
+
+    char *names[] = {"euclidean", "cosine", "hamming"};
+    double (*metrics[])(Image *, Image *) = {distance_euclidean, distance_cosine,
+                                             distance_hamming};
+    int links[] = {8, 16};
+    int sweep[] = {10, 20, 50, 100};
+    for (int m = 0; m < 3; m++) {
+        printf("%s, K %d:\n", names[m], K);
+        printf("%-14s %10s %10s %10s %8s %9s\n", "index", "build (s)", "time (s)",
+               "images/s", "correct", "disagree");
+        double t = run(training, testing, K, metrics[m], exact);
+        report("scan", 0, t, testing, exact, exact);
+        for (int l = 0; l < sizeof(links) / sizeof(links[0]); l++) {
+            for (int s = 0; s < sizeof(sweep) / sizeof(sweep[0]); s++) {
+                double start = now();
+                build_hnsw(training, metrics[m], links[l], sweep[s]);
+                double t_build = now() - start;
+                char name[32];
+                snprintf(name, sizeof(name), "hnsw M%d ef%d", links[l], sweep[s]);
+                t = run(training, testing, K, metrics[m], approx);
+                report(name, t_build, t, testing, approx, exact);
+                free_hnsw(training);
+            }
+        }
+    }
+
+    free(exact);
+    free(approx);
+    free_dataset(training);
+    free_dataset(testing);
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "knn.h"
+
+/* A benchmark of the two dataset layouts: images pointing into the mapped
+ * file (load_dataset) and an aligned slab of padded rows
+ * (load_dataset_slab). Prints the time to load the training set with each,
+ * and for each K the time to classify the test set with the euclidean
+ * distance (the best of REPEATS runs), checking that both layouts give the
+ * same predictions.
+ *
+ *    make bench_layout
+ *    ./bench_layout datasets/training_1000.bin datasets/testing_1000.bin
+ */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Load filename with load, exiting if it cannot be loaded, and store the
+ * time taken in *elapsed.
+ */
+Dataset *timed_load(Dataset *(*load)(const char *), const char *filename, double *elapsed) {
+    double start = now();
+    Dataset *data = load(filename);
+    *elapsed = now() - start;
+    if (data == NULL) {
+        fprintf(stderr, "The data set in %s could not be loaded\n", filename);
+        exit(1);
+    }
+    return data;
+}
+
+/* Classify every image in testing against training, storing the predictions
+ * in predictions and returning the best time taken over REPEATS runs.
+ */
+#define REPEATS 3
+double run(Dataset *training, Dataset *testing, int K, int *predictions) {
+    double best = INFINITY;
+    for (int r = 0; r < REPEATS; r++) {
+        double start = now();
+        for (int i = 0; i < testing->num_items; i++) {
+            predictions[i] = knn_predict(training, &testing->images[i], K, distance_euclidean);
+        }
+        best = fmin(best, now() - start);
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s training_data testing_data\n", argv[0]);
+        exit(1);
+    }
+    double t_mmap, t_slab, unused;
+    Dataset *mapped = timed_load(load_dataset, argv[1], &t_mmap);
+    Dataset *slab = timed_load(load_dataset_slab, argv[1], &t_slab);
+    Dataset *testing = timed_load(load_dataset, argv[2], &unused);
+    order_blocks_by_variance(mapped);
+
+    printf("load %d images: mmap %.4fs, slab %.4fs\n", mapped->num_items, t_mmap, t_slab);
+
+    int *expected = malloc(sizeof(int) * testing->num_items);
+    int *predictions = malloc(sizeof(int) * testing->num_items);
+    int sweep[] = {1, 7, 50};
+    printf("%5s %10s %10s %8s %9s\n", "K", "mmap (s)", "slab (s)", "speedup", "disagree");
+    for (int s = 0; s < sizeof(sweep) / sizeof(sweep[0]); s++) {
+        double t_plain = run(mapped, testing, sweep[s], expected);
+        double t_rows = run(slab, testing, sweep[s], predictions);
+        int disagree = 0;
+        for (int i = 0; i < testing->num_items; i++) {
+            disagree += predictions[i] != expected[i];
+        }
+        printf("%5d %10.4f %10.4f %7.2fx %9d\n", sweep[s], t_plain, t_rows, t_plain / t_rows,
+               disagree);
+    }
+
+    free(expected);
+    free(predictions);
+    free_dataset(mapped);
+    free_dataset(slab);
+    free_dataset(testing);
+    return 0;
+}
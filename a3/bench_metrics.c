@@ -0,0 +1,97 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "knn.h"
+
+/* A benchmark of the metrics in the registry (see metrics). For each it
+ * classifies the test set with the metric's own scan, which inlines its
+ * kernel, and with the loop that calls the metric through a pointer for
+ * every training image (the best of REPEATS runs each), printing the
+ * images classified per second both ways and checking that they make the
+ * same predictions. The training set is in a slab (see load_dataset_slab)
+ * and both sets are binarized for hamming.
+ *
+ *    make bench_metrics
+ *    ./bench_metrics datasets/training_1000.bin datasets/testing_1000.bin [K]
+ */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A metric knn_predict has no scan for, since it is not in the registry:
+ * it just calls the one in wrapped.
+ */
+double (*wrapped)(Image *, Image *);
+
+double through_pointer(Image *a, Image *b) {
+    return wrapped(a, b);
+}
+
+/* Classify every image in testing against training with fptr, storing the
+ * predictions in predictions and returning the best time taken over
+ * REPEATS runs.
+ */
+#define REPEATS 3
+double run(Dataset *training, Dataset *testing, int K, double (*fptr)(Image *, Image *),
+           int *predictions) {
+    double best = INFINITY;
+    for (int r = 0; r < REPEATS; r++) {
+        double start = now();
+        for (int i = 0; i < testing->num_items; i++) {
+            predictions[i] = knn_predict(training, &testing->images[i], K, fptr);
+        }
+        best = fmin(best, now() - start);
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s training_data testing_data [K]\n", argv[0]);
+        exit(1);
+    }
+    int K = argc == 4 ? atoi(argv[3]) : 1;
+    Dataset *training = load_dataset_slab(argv[1]);
+    Dataset *testing = load_dataset(argv[2]);
+    if (training == NULL || testing == NULL) {
+        fprintf(stderr, "The data sets could not be loaded\n");
+        exit(1);
+    }
+    order_blocks_by_variance(training);
+    binarize_dataset(training);
+    binarize_dataset(testing);
+    int *scanned = malloc(sizeof(int) * testing->num_items);
+    int *called = malloc(sizeof(int) * testing->num_items);
+
+    printf("K %d, %d training images, %d test images\n", K, training->num_items,
+           testing->num_items);
+    printf("%-10s %10s %10s %12s %10s %8s %8s\n", "metric", "scan (s)", "images/s",
+           "pointer (s)", "images/s", "speedup", "correct");
+    for (int m = 0; m < NUM_METRICS; m++) {
+        double t_scan = run(training, testing, K, metrics[m].fptr, scanned);
+        wrapped = metrics[m].fptr;
+        double t_called = run(training, testing, K, through_pointer, called);
+        int correct = 0;
+        for (int i = 0; i < testing->num_items; i++) {
+            if (scanned[i] != called[i]) {
+                fprintf(stderr, "%s: test image %d is %d by the scan and %d by the pointer\n",
+                        metrics[m].name, i, scanned[i], called[i]);
+                exit(1);
+            }
+            correct += scanned[i] == testing->labels[i];
+        }
+        printf("%-10s %10.4f %10.0f %12.4f %10.0f %7.1fx %8d\n", metrics[m].name, t_scan,
+               testing->num_items / t_scan, t_called, testing->num_items / t_called,
+               t_called / t_scan, correct);
+    }
+
+    free(scanned);
+    free(called);
+    free_dataset(training);
+    free_dataset(testing);
+    return 0;
+}
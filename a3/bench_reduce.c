@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "knn.h"
+
+/* A benchmark of classifying by the euclidean distance between projected
+ * images. For PCA and random projections to a sweep of dimensions it
+ * prints the time taken to learn the projection and to project both sets,
+ * the time taken to classify the test set, the number classified correctly
+ * and how that differs from classifying by the distance between the pixels.
+ *
+ *    make bench_reduce
+ *    ./bench_reduce datasets/training_1000.bin datasets/testing_1000.bin [K]
+ */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Classify every image in testing, storing the number classified correctly
+ * in *correct and returning the time taken.
+ */
+double run(Dataset *training, Dataset *testing, int K, int *correct) {
+    double start = now();
+    *correct = 0;
+    for (int i = 0; i < testing->num_items; i++) {
+        *correct += knn_predict(training, &testing->images[i], K, distance_euclidean) ==
+                    testing->labels[i];
+    }
+    return now() - start;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s training_data testing_data [K]\n", argv[0]);
+        exit(1);
+    }
+    int K = argc == 4 ? atoi(argv[3]) : 1;
+    Dataset *training = load_dataset(argv[1]);
+    Dataset *testing = load_dataset(argv[2]);
+    if (training == NULL || testing == NULL) {
+        fprintf(stderr, "The data sets could not be loaded\n");
+        exit(1);
+    }
+
+    int exact;
+    double t_exact = run(training, testing, K, &exact);
+    printf("K %d, %d test images\n", K, testing->num_items);
+    printf("%-12s %10s %10s %10s %8s %7s\n", "projection", "learn (s)", "proj (s)",
+           "knn (s)", "correct", "delta");
+    printf("%-12s %10s %10s %10.4f %8d %7d\n", "pixels", "-", "-", t_exact, exact, 0);
+
+    int sweep[] = {16, 32, 48, 64};
+    for (int method = 0; method < 2; method++) {
+        for (int s = 0; s < sizeof(sweep) / sizeof(sweep[0]); s++) {
+            double start = now();
+            struct Projection *p = method == 0 ? pca_projection(training, sweep[s])
+                                               : random_projection(sweep[s], 209);
+            double t_learn = now() - start;
+            start = now();
+            project_dataset(training, p);
+            project_dataset(testing, p);
+            double t_proj = now() - start;
+            free_projection(p);
+
+            int correct;
+            double t = run(training, testing, K, &correct);
+            char name[32];
+            snprintf(name, sizeof(name), "%s %d", method == 0 ? "pca" : "random", sweep[s]);
+            printf("%-12s %10.4f %10.4f %10.4f %8d %+7d\n", name, t_learn, t_proj, t, correct,
+                   correct - exact);
+        }
+    }
+
+    free_dataset(training);
+    free_dataset(testing);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "knn.h"
+
+/* A benchmark of the top-K selection in knn_predict for a range of K.
+ * Each K is run once with knn_predict and once with the selection it used
+ * to have, which rescans all K slots for the maximum for every training
+ * image. The number of test images on which the two disagree is reported
+ * too; it is always 0, since the heap keeps the same images as the rescan.
+ *
+ *    make bench_topk
+ *    ./bench_topk datasets/training_1000.bin datasets/testing_100.bin
+ */
+
+typedef struct {
+    double dist;
+    int img_idx;
+} Slot;
+
+/* knn_predict with the old O(K) rescan per training image.
+ */
+int knn_predict_rescan(Dataset *data, Image *input, int K, double (*fptr)(Image *, Image *)) {
+    Slot smallest[K];
+    for (int i = 0; i < K; i++) {
+        smallest[i].dist = INFINITY;
+        smallest[i].img_idx = 0;
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        double dist = fptr(&data->images[i], input);
+        double max_dist = -1;
+        int max_index = 0;
+        for (int j = 0; j < K; j++) {
+            if (smallest[j].dist > max_dist) {
+                max_dist = smallest[j].dist;
+                max_index = j;
+            }
+        }
+        if (dist < max_dist) {
+            smallest[max_index].dist = dist;
+            smallest[max_index].img_idx = i;
+        }
+    }
+    int counts[10] = {0};
+    for (int i = 0; i < K; i++) {
+        counts[data->labels[smallest[i].img_idx]]++;
+    }
+    int max_count = 0, max_label = 1;
+    for (int i = 0; i < 10; i++) {
+        if (counts[i] > max_count) {
+            max_count = counts[i];
+            max_label = i;
+        }
+    }
+    return max_label;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s training_data testing_data\n", argv[0]);
+        exit(1);
+    }
+    Dataset *training = load_dataset(argv[1]);
+    Dataset *testing = load_dataset(argv[2]);
+    if (training == NULL || testing == NULL) {
+        fprintf(stderr, "The data sets could not be loaded\n");
+        exit(1);
+    }
+
+    int sweep[] = {1, 5, 10, 25, 50, 100, 200};
+    printf("%5s %12s %12s %8s %9s\n", "K", "rescan (s)", "heap (s)", "speedup", "disagree");
+    for (int s = 0; s < (int)(sizeof(sweep) / sizeof(sweep[0])); s++) {
+        int K = sweep[s];
+        int disagree = 0;
+        double t_rescan = 0, t_heap = 0;
+        for (int i = 0; i < testing->num_items; i++) {
+            double t0 = now();
+            int old = knn_predict_rescan(training, &testing->images[i], K, distance_euclidean);
+            double t1 = now();
+            int new = knn_predict(training, &testing->images[i], K, distance_euclidean);
+            double t2 = now();
+            t_rescan += t1 - t0;
+            t_heap += t2 - t1;
+            disagree += old != new;
+        }
+        printf("%5d %12.4f %12.4f %7.2fx %9d\n", K, t_rescan, t_heap, t_rescan / t_heap, disagree);
+    }
+
+    free_dataset(training);
+    free_dataset(testing);
+    return 0;
+}
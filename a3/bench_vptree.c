@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "knn.h"
+
+/* A benchmark of the vantage-point tree index. For each metric it times
+ * building the tree, then for each K classifies the test set by scanning
+ * every training image and by searching the tree, printing both times, the
+ * fraction of the distances the tree search computed (counting every image
+ * for a test image it had to scan because of ties) and the number of
+ * predictions that differ, which must be 0: it exits with status 1 if not.
+ *
+ *    make bench_vptree
+ *    ./bench_vptree datasets/training_1000.bin datasets/testing_1000.bin
+ */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Classify every image in testing, storing the predictions in predictions
+ * and returning the time taken.
+ */
+double run(Dataset *training, Dataset *testing, int K, double (*fptr)(Image *, Image *),
+           int *predictions) {
+    double start = now();
+    for (int i = 0; i < testing->num_items; i++) {
+        predictions[i] = knn_predict(training, &testing->images[i], K, fptr);
+    }
+    return now() - start;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s training_data testing_data\n", argv[0]);
+        exit(1);
+    }
+    Dataset *training = load_dataset(argv[1]);
+    Dataset *testing = load_dataset(argv[2]);
+    if (training == NULL || testing == NULL) {
+        fprintf(stderr, "The data sets could not be loaded\n");
+        exit(1);
+    }
+    binarize_dataset(training);
+    binarize_dataset(testing);
+    int *scan = malloc(sizeof(int) * testing->num_items);
+    int *tree = malloc(sizeof(int) * testing->num_items);
+
+    char *names[] = {"euclidean", "cosine", "hamming"};
+    double (*metrics[])(Image *, Image *) = {distance_euclidean, distance_cosine,
+                                             distance_hamming};
+    int sweep[] = {1, 5, 7, 50};
+    int total_disagree = 0;
+    for (int m = 0; m < 3; m++) {
+        double start = now();
+        build_vptree(training, metrics[m]);
+        printf("%s: built in %.3fs\n", names[m], now() - start);
+        printf("%5s %10s %10s %10s %9s\n", "K", "scan (s)", "tree (s)", "computed",
+               "disagree");
+        for (int s = 0; s < sizeof(sweep) / sizeof(sweep[0]); s++) {
+            struct VpTree *index = training->vptree;
+            training->vptree = NULL;
+            double t_scan = run(training, testing, sweep[s], metrics[m], scan);
+            training->vptree = index;
+
+            long long computed0, searched0, computed1, searched1;
+            knn_vptree_stats(&computed0, &searched0);
+            double t_tree = run(training, testing, sweep[s], metrics[m], tree);
+            knn_vptree_stats(&computed1, &searched1);
+
+            int disagree = 0;
+            for (int i = 0; i < testing->num_items; i++) {
+                disagree += scan[i] != tree[i];
+            }
+            printf("%5d %10.4f %10.4f %9.1f%% %9d\n", sweep[s], t_scan, t_tree,
+                   100.0 * (computed1 - computed0) / (searched1 - searched0), disagree);
+            total_disagree += disagree;
+        }
+        free_vptree(training);
+    }
+
+    free(scan);
+    free(tree);
+    free_dataset(training);
+    free_dataset(testing);
+    if (total_disagree > 0) {
+        fprintf(stderr, "The tree disagreed with the scan %d times\n", total_disagree);
+        return 1;
+    }
+    return 0;
+}
@@ -16,11 +16,16 @@
  * main() takes in the following command line arguments.
  *   -K <num>:  K value for kNN (default is 1)
  *   -d <distance metric>: a string for the distance function to use
- *          euclidean or cosine (or initial substring such as "eucl", or "cos")
+ *          euclidean, cosine, manhattan, chebyshev or hamming (or initial
+ *          substring such as "eucl", or "cos"; see find_metric)
  *   -p <num_procs>: The number of processes to use to test images
  *   -v : If this argument is provided, then print additional debugging information
  *        (You are welcome to add print statements that only print with the verbose
  *         option.  We will not be running tests with -v )
+ *   -x <folds>: Sweep instead: for each metric in -d (a comma-separated list,
+ *        or "all"), score every K up to -K with folds-fold cross-validation
+ *        over the training data and on the testing data, using -p threads,
+ *        and print a table of the accuracies instead of one number
  *   training_data: A binary file containing training image / label data
  *   testing_data: A binary file containing testing image / label data
  *   (Note that the first three "option" arguments (-K <num>, -d <distance metric>,
@@ -29,23 +34,25 @@
  * 
  * You need to do the following:
  *   - Parse the command line arguments, call `load_dataset()` appropriately.
- *   - Create the pipes to communicate to and from children
+ *   - Create the pipes to communicate to and from children (in server mode)
  *   - Fork and create children, close ends of pipes as needed
- *   - All child processes should call `child_handler()`, and exit after.
- *   - Parent distributes the test dataset among children by writing:
- *        (1) start_idx: The index of the image the child should start at
- *        (2)    N:      Number of images to process (starting at start_idx)
- *     Each child should get at most N = ceil(test_set_size / num_procs) images
- *      (The last child might get fewer if the numbers don't divide perfectly)
- *   - Parent waits for children to exit, reads results through pipes and keeps
- *      the total sum.
+ *   - All child processes should call `child_handler_queue()`, and exit after.
+ *   - The children take the test images from a queue in shared memory: in
+ *     chunks that shrink as the images run out (-w dynamic, the default), so
+ *     that they all finish at about the same time, or one fixed slice of at
+ *     most ceil(test_set_size / num_procs) images each (-w static).
+ *   - The children write their predictions to a result area in shared
+ *      memory, one slot per test image, and wake the parent through a futex
+ *      as they go; the parent keeps the total sum from it (shown as it grows
+ *      with -v) and reaps the children.
  *   - Print out (only) one integer to stdout representing the number of test 
  *      images that were correctly classified by all children.
  *   - Free all the data allocated and exit.
  *   - Handle all relevant errors, exiting as appropriate and printing error message to stderr
  */
 void usage(char *name) {
-    fprintf(stderr, "Usage: %s -v -K <num> -d <distance metric> -p <num_procs> training_list testing_list\n", name);
+    fprintf(stderr, "Usage: %s -v -K <num> -d <distance metric> -p <num_procs> -l <mmap|slab> -i <none|vptree|hnsw> -M <links> -e <ef> -r <none|pca|random> -D <dims> -w <dynamic|static> -o <predictions_file> -b <processes|threads> -a <none|pin|replicate> -x <folds> training_list testing_list\n", name);
+    fprintf(stderr, "       %s -s [options] training_list < testing_lists\n", name);
 }
 
 int main(int argc, char *argv[]) {
@@ -55,13 +62,40 @@ int main(int argc, char *argv[]) {
     char *dist_metric = "euclidean"; // default distant metric
     int num_procs = 1;     // default number of children to create
     int verbose = 0;       // if verbose is 1, print extra debugging statements
+    char *layout = "mmap"; // how to hold the datasets in memory
+    char *index = "none";  // index to search instead of every training image
+    int hnsw_m = 16;       // links per node of the hnsw graph
+    int hnsw_ef = 50;      // nodes a search of the hnsw graph keeps
+    char *reduce = "none"; // projection of the images to fewer dimensions
+    int dims = 48;         // dimensions to project the images to
+    int server = 0;        // if server is 1, classify the testing sets named on stdin
+    char *schedule = "dynamic"; // how the test images are split among the children
+    char *predictions_file = NULL; // where to write the prediction for each test image
+    char *backend = "processes";   // what the workers run in
+    char *affinity = NULL;         // where the workers run (pin with threads, none with processes)
+    int folds = 0;         // if more than 0, sweep K and the metrics with this many folds
     int total_correct = 0; // Number of correct predictions
 
-    while((opt = getopt(argc, argv, "vK:d:p:")) != -1) {
+    while((opt = getopt(argc, argv, "vsK:d:p:l:i:M:e:r:D:w:o:b:a:x:")) != -1) {
         switch(opt) {
         case 'v':
             verbose = 1;
             break;
+        case 's':
+            server = 1;
+            break;
+        case 'w':
+            schedule = optarg;
+            break;
+        case 'o':
+            predictions_file = optarg;
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        case 'a':
+            affinity = optarg;
+            break;
         case 'K':
             K = atoi(optarg);
             break;
@@ -71,20 +105,41 @@ int main(int argc, char *argv[]) {
         case 'p':
             num_procs = atoi(optarg);
             break;
+        case 'l':
+            layout = optarg;
+            break;
+        case 'i':
+            index = optarg;
+            break;
+        case 'M':
+            hnsw_m = atoi(optarg);
+            break;
+        case 'e':
+            hnsw_ef = atoi(optarg);
+            break;
+        case 'r':
+            reduce = optarg;
+            break;
+        case 'D':
+            dims = atoi(optarg);
+            break;
+        case 'x':
+            folds = atoi(optarg);
+            break;
         default:
             usage(argv[0]);
             exit(1);
         }
     }
 
-    if(optind >= argc) {
+    if(optind >= argc || (!server && optind + 1 >= argc)) {
         fprintf(stderr, "Expecting training images file and test images file\n");
         exit(1);
     } 
 
     char *training_file = argv[optind];
     optind++;
-    char *testing_file = argv[optind];
+    char *testing_file = server ? NULL : argv[optind];
 
     // TODO The following lines are included to prevent compiler warnings
     // and should be removed when you use the variables.
@@ -103,178 +158,397 @@ int main(int argc, char *argv[]) {
      */ 
   
     // TODO
-    int dist_euclid = -1; // = 1 if euclidean else = 0 if cosine
-    if (strncmp(dist_metric, "euclidean", strlen(dist_metric)) == 0 ||
-    strncmp(dist_metric, "eucl", 4) == 0) {
-        dist_euclid = 1;
-        
-    } else if ((strncmp(dist_metric, "cosine", strlen(dist_metric)) == 0 ||
-    strncmp(dist_metric, "cos", 3) == 0)) {
-        dist_euclid = 0;
+    // A sweep takes a list of metrics (which are all known, as checked here)
+    const Metric *sweep[NUM_METRICS];
+    int num_sweep = 0;
+    if (folds != 0 && strcmp(dist_metric, "all") == 0) {
+        for (int m = 0; m < NUM_METRICS; m++) {
+            sweep[num_sweep++] = &metrics[m];
+        }
+        dist_metric = (char *)metrics[0].name;
+    } else if (folds != 0) {
+        char names[strlen(dist_metric) + 1];
+        strcpy(names, dist_metric);
+        for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+            const Metric *m = find_metric(name);
+            if (m == NULL || num_sweep == NUM_METRICS) {
+                fprintf(stderr, "Unknown distance metric %s (or too many)\n", name);
+                usage(argv[0]);
+                exit(1);
+            }
+            sweep[num_sweep++] = m;
+        }
+        dist_metric = num_sweep > 0 ? (char *)sweep[0]->name : "";
     }
 
+    const Metric *metric = find_metric(dist_metric);
+    if (metric == NULL) {
+        fprintf(stderr, "Unknown distance metric %s\n", dist_metric);
+        usage(argv[0]);
+        exit(1);
+    }
+    double (*fptr)(Image *, Image *) = metric->fptr;
+
+
+    // Either point the images into the mapped files or copy them into an
+    // aligned slab, which the euclidean search can scan more quickly
+    Dataset *(*load)(const char *) = NULL;
+    if (strcmp(layout, "mmap") == 0) {
+        load = load_dataset;
+    } else if (strcmp(layout, "slab") == 0) {
+        load = load_dataset_slab;
+    } else {
+        fprintf(stderr, "Unknown layout %s\n", layout);
+        usage(argv[0]);
+        exit(1);
+    }
+    if (strcmp(index, "none") != 0 && strcmp(index, "vptree") != 0 &&
+        strcmp(index, "hnsw") != 0) {
+        fprintf(stderr, "Unknown index %s\n", index);
+        usage(argv[0]);
+        exit(1);
+    }
+    if ((strcmp(backend, "processes") != 0 && strcmp(backend, "threads") != 0) ||
+        (server && strcmp(backend, "threads") == 0)) {
+        fprintf(stderr, "Unknown backend %s (server mode needs processes)\n", backend);
+        usage(argv[0]);
+        exit(1);
+    }
+    if (affinity == NULL) {
+        affinity = strcmp(backend, "threads") == 0 ? "pin" : "none";
+    }
+    if (strcmp(affinity, "none") != 0 && strcmp(affinity, "pin") != 0 &&
+        strcmp(affinity, "replicate") != 0) {
+        fprintf(stderr, "Unknown affinity %s\n", affinity);
+        usage(argv[0]);
+        exit(1);
+    }
+    if (strcmp(schedule, "dynamic") != 0 && strcmp(schedule, "static") != 0) {
+        fprintf(stderr, "Unknown schedule %s\n", schedule);
+        usage(argv[0]);
+        exit(1);
+    }
+    if (strcmp(reduce, "none") != 0 && strcmp(reduce, "pca") != 0 &&
+        strcmp(reduce, "random") != 0) {
+        fprintf(stderr, "Unknown projection %s\n", reduce);
+        usage(argv[0]);
+        exit(1);
+    }
+    if (strcmp(reduce, "none") != 0 &&
+        (fptr != distance_euclidean || strcmp(index, "none") != 0 || dims < 1 || dims > NUM_PIXELS)) {
+        fprintf(stderr, "A projection needs the euclidean metric, no index and 1 to %d dims\n",
+                NUM_PIXELS);
+        usage(argv[0]);
+        exit(1);
+    }
+    if (hnsw_m < 2 || hnsw_ef < 1) {
+        fprintf(stderr, "The hnsw graph needs -M of at least 2 and -e of at least 1\n");
+        usage(argv[0]);
+        exit(1);
+    }
+    if (folds != 0 && (folds < 2 || K < 1 || num_procs < 1 || server ||
+                       strcmp(index, "none") != 0 || strcmp(reduce, "none") != 0)) {
+        fprintf(stderr, "A sweep needs at least 2 folds, K and -p of at least 1, no index, "
+                "no projection and no server mode\n");
+        usage(argv[0]);
+        exit(1);
+    }
 
     // Load data sets
     if(verbose) {
         fprintf(stderr,"- Loading datasets...\n");
     }
     
-    Dataset *training = load_dataset(training_file);
+    Dataset *training = load(training_file);
     if ( training == NULL ) {
         fprintf(stderr, "The data set in %s could not be loaded\n", training_file);
         exit(1);
     }
+    order_blocks_by_variance(training);
 
-    Dataset *testing = load_dataset(testing_file);
-    if ( testing == NULL ) {
-        fprintf(stderr, "The data set in %s could not be loaded\n", testing_file);
-        exit(1);
+    // In server mode the testing sets are read later, one after another
+    Dataset *testing = NULL;
+    if (!server) {
+        testing = load(testing_file);
+        if ( testing == NULL ) {
+            fprintf(stderr, "The data set in %s could not be loaded\n", testing_file);
+            exit(1);
+        }
     }
 
-    // Create the pipes and child processes who will then call child_handler
-    if(verbose) {
-        printf("- Creating children ...\n");
+    // A sweep finds the K nearest neighbours of each image once per metric
+    // and scores every smaller K from them too, so the whole table costs
+    // about what one run per fold does
+    if (folds != 0) {
+        for (int m = 0; m < num_sweep; m++) {
+            if (sweep[m]->binarized) {
+                binarize_dataset(training);
+                binarize_dataset(testing);
+            }
+        }
+        int *cv_correct = malloc(sizeof(int) * K * num_sweep);
+        int *test_correct = malloc(sizeof(int) * K * num_sweep);
+        if (cv_correct == NULL || test_correct == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int m = 0; m < num_sweep; m++) {
+            if (verbose) {
+                fprintf(stderr, "- Sweeping %s\n", sweep[m]->name);
+            }
+            cross_validate(training, testing, folds, K, sweep[m]->fptr, num_procs,
+                           cv_correct + m * K, test_correct + m * K);
+        }
+
+        // One row per K, with the cross-validated and the test accuracy of
+        // each metric, and the best by cross-validation at the end
+        double cv_total = training->num_items > 0 ? training->num_items : 1;
+        double test_total = testing->num_items > 0 ? testing->num_items : 1;
+        printf("%4s", "K");
+        for (int m = 0; m < num_sweep; m++) {
+            char label[32];
+            snprintf(label, sizeof(label), "%s cv", sweep[m]->name);
+            printf(" %13s %7s", label, "test");
+        }
+        printf("\n");
+        int best = 0;
+        for (int k = 0; k < K; k++) {
+            printf("%4d", k + 1);
+            for (int m = 0; m < num_sweep; m++) {
+                int i = m * K + k;
+                printf(" %12.2f%% %6.2f%%", 100 * cv_correct[i] / cv_total,
+                       100 * test_correct[i] / test_total);
+                if (cv_correct[i] > cv_correct[best]) {
+                    best = i;
+                }
+            }
+            printf("\n");
+        }
+        printf("Best by %d-fold cross-validation: %s with K %d (%.2f%% cv, %.2f%% test)\n",
+               folds, sweep[best / K]->name, best % K + 1, 100 * cv_correct[best] / cv_total,
+               100 * test_correct[best] / test_total);
+
+        free(cv_correct);
+        free(test_correct);
+        free_dataset(training);
+        free_dataset(testing);
+        return 0;
     }
 
-    // TODO
-    int fds1[num_procs][2];
-    int fds2[num_procs][2];
-    int status;
+    // The hamming distance compares the binarized images
+    if (metric->binarized) {
+        binarize_dataset(training);
+        if (testing != NULL) {
+            binarize_dataset(testing);
+        }
+    }
 
-    for (int i = 0; i < num_procs; i++) {
-        if (pipe(fds1[i]) == -1) {
-            perror("pipe fds1");
-            exit(1);
-        } 
-        if (pipe(fds2[i]) == -1) {
-            perror("pipe fds2");
-            exit(1);
+    // Project both sets into the space learnt from the training set
+    struct Projection *projection = NULL;
+    if (strcmp(reduce, "none") != 0) {
+        projection = strcmp(reduce, "pca") == 0 ? pca_projection(training, dims)
+                                                : random_projection(dims, 209);
+        project_dataset(training, projection);
+        if (testing != NULL) {
+            project_dataset(testing, projection);
         }
-        int result = fork();
-        if (result < 0) {
-            perror("fork");
-            exit(1);
-        } else if (result == 0) {
-            if (close(fds1[i][1]) == -1) {
-                perror("close fds1");
-                exit(1);
+        if (verbose) {
+            fprintf(stderr, "- Projected the images to %d dimensions by %s\n", dims, reduce);
+        }
+    }
+
+    // Build (or load) the index before forking, so all the children share it
+    if (strcmp(index, "vptree") == 0) {
+        int loaded = attach_vptree(training, training_file, fptr, metric->name);
+        if (verbose) {
+            fprintf(stderr, "- %s the vantage-point tree\n", loaded ? "Loaded" : "Built");
+        }
+    } else if (strcmp(index, "hnsw") == 0) {
+        // Approximate: the search may miss some of the K nearest images
+        build_hnsw(training, fptr, hnsw_m, hnsw_ef);
+        if (verbose) {
+            fprintf(stderr, "- Built the hnsw graph (M %d, ef %d)\n", hnsw_m, hnsw_ef);
+        }
+    }
+
+    // Where the workers go: pinned to cores split evenly across the NUMA
+    // nodes, and with a copy of the training set on each node to replicate
+    struct Placement *placement = NULL;
+    if (strcmp(affinity, "none") != 0) {
+        placement = new_placement(training, strcmp(affinity, "replicate") == 0);
+        if (verbose) {
+            fprintf(stderr, "- Placing the workers (%s)\n", affinity);
+        }
+    }
+
+    // The queue the workers take the test images from and the area they
+    // store their predictions in, made before forking so that they are
+    // shared by them
+    struct WorkQueue *queue = NULL;
+    struct ResultArea *results = NULL;
+    if (!server) {
+        queue = new_work_queue(testing->num_items, num_procs, strcmp(schedule, "dynamic") == 0);
+        results = new_result_area(testing->num_items);
+    }
+
+    if (strcmp(backend, "threads") == 0) {
+        // The threads share the datasets as they are
+        total_correct = classify_threads(training, testing, K, fptr, queue, results, placement,
+                                         verbose);
+    } else {
+        // Create the child processes who will then call child_handler_queue
+        // (or, in server mode, worker_handler over pipes)
+        if(verbose) {
+            printf("- Creating children ...\n");
+        }
+        fflush(stdout);  // Or each child would print it again when it exits
+
+        // TODO
+        // Only server mode talks to the children through pipes: otherwise
+        // they need no file descriptors, so num_procs is not bounded by them
+        int num_pipes = server ? num_procs : 1;
+        int fds1[num_pipes][2];
+        int fds2[num_pipes][2];
+        int status;
+
+        for (int i = 0; i < num_procs; i++) {
+            if (server) {
+                if (pipe(fds1[i]) == -1) {
+                    perror("pipe fds1");
+                    exit(1);
+                }
+                if (pipe(fds2[i]) == -1) {
+                    perror("pipe fds2");
+                    exit(1);
+                }
             }
-            if (close(fds2[i][0]) == -1) {
-                perror("close fds2");
+            int result = fork();
+            if (result < 0) {
+                perror("fork");
                 exit(1);
-            }
+            } else if (result == 0) {
+                Dataset *local = training;
+                if (placement != NULL) {
+                    local = place_worker(placement, training, i, queue);
+                }
+                if (!server) {
+                    child_handler_queue(local, testing, K, fptr, queue, i, results);
+                    exit(0);
+                }
 
-            for (int k = 0; k < i; k++) {
-                if (close(fds1[k][1]) == -1) {
+                if (close(fds1[i][1]) == -1) {
                     perror("close fds1");
                     exit(1);
                 }
-                if (close(fds2[k][0]) == -1) {
+                if (close(fds2[i][0]) == -1) {
                     perror("close fds2");
                     exit(1);
                 }
-            }
 
-            if (dist_euclid == 1) { // euclidean
-                child_handler(training, testing, K, distance_euclidean, fds1[i][0], fds2[i][1]);
-                
-            } else if (dist_euclid == 0) { // cosine
-                child_handler(training, testing, K, distance_cosine, fds1[i][0], fds2[i][1]);
-            }
-            if (close(fds1[i][0]) == -1) {
-                perror("close fds1");
-                exit(1);
-            }
-            if (close(fds2[i][1]) == -1) {
-                perror("close fds2");
-                exit(1);
-            }
-            exit(0);
-        }
-    }
-    // Distribute the work to the children by writing their starting index and
-    // the number of test images to process to their write pipe
+                for (int k = 0; k < i; k++) {
+                    if (close(fds1[k][1]) == -1) {
+                        perror("close fds1");
+                        exit(1);
+                    }
+                    if (close(fds2[k][0]) == -1) {
+                        perror("close fds2");
+                        exit(1);
+                    }
+                }
 
-    // TODO
-    int test_set_size = testing->num_items;
-    int base_num = floor(test_set_size / num_procs);
-    int modulo = test_set_size % num_procs;
-
-    int starting_index = 0;
-    for (int i = 0; i < num_procs; i++) {
-        if (close(fds1[i][0]) == -1) {
-            perror("close fds1");
-            exit(1);
-        }
-        if (i < modulo) {
-            if (write(fds1[i][1], &starting_index, sizeof(int)) == -1) {
-                perror("write fds1");
-                exit(1);
-            }
-            int num = base_num + 1;
-            if (write(fds1[i][1], &num, sizeof(int)) == -1) {
-                perror("write fds1");
-                exit(1);
+                worker_handler(local, K, fptr, projection, fds1[i][0], fds2[i][1]);
+                if (close(fds1[i][0]) == -1) {
+                    perror("close fds1");
+                    exit(1);
+                }
+                if (close(fds2[i][1]) == -1) {
+                    perror("close fds2");
+                    exit(1);
+                }
+                exit(0);
             }
-            starting_index += num;
-            if (close(fds1[i][1]) == -1) {
-                perror("close fds1");
-                exit(1);
+        }
+        // In server mode the children stay up: stream the images of each
+        // testing set named on a line of stdin to them in batches, and print
+        // the number classified correctly (or -1 if the set could not be
+        // loaded) on a line of its own, until the end of the input
+        if (server) {
+            int to_workers[num_procs];
+            int from_workers[num_procs];
+            for (int i = 0; i < num_procs; i++) {
+                if (close(fds1[i][0]) == -1 || close(fds2[i][1]) == -1) {
+                    perror("close");
+                    exit(1);
+                }
+                to_workers[i] = fds1[i][1];
+                from_workers[i] = fds2[i][0];
             }
-        } else {
-            if (write(fds1[i][1], &starting_index, sizeof(int)) == -1) {
-                perror("write fds1");
-                exit(1);
+
+            char line[4096];
+            while (fgets(line, sizeof(line), stdin) != NULL) {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0] == '\0') {
+                    continue;
+                }
+                testing = load_dataset(line);
+                if (testing == NULL) {
+                    fprintf(stderr, "The data set in %s could not be loaded\n", line);
+                    printf("-1\n");
+                } else {
+                    int correct = classify_batches(testing, num_procs, to_workers, from_workers);
+                    if (verbose) {
+                        fprintf(stderr, "- %s: %d of %d correct\n", line, correct,
+                                testing->num_items);
+                    }
+                    printf("%d\n", correct);
+                    free_dataset(testing);
+                }
+                fflush(stdout);
             }
-            if (write(fds1[i][1], &base_num, sizeof(int)) == -1) {
-                perror("write fds1");
-                exit(1);
+
+            // An empty message tells each worker to exit
+            for (int i = 0; i < num_procs; i++) {
+                send_message(to_workers[i], NULL, 0);
+                if (close(to_workers[i]) == -1) {
+                    perror("close");
+                    exit(1);
+                }
             }
-            starting_index += base_num;
-            if (close(fds1[i][1]) == 1) {
-                perror("close fds1");
-                exit(1);
+            for (int i = 0; i < num_procs; i++) {
+                if (wait(&status) == -1) {
+                    perror("wait");
+                    exit(1);
+                }
+                if (close(from_workers[i]) == -1) {
+                    perror("close");
+                    exit(1);
+                }
             }
+            free_placement(placement);
+            free_projection(projection);
+            free_dataset(training);
+            return 0;
         }
-    }
-
-
-    // Wait for children to finish
-    if(verbose) {
-        printf("- Waiting for children...\n");
-    }
 
-    // TODO
-    for (int i = 0; i < num_procs; i++) {
-        if (wait(&status) == -1) {
-            perror("wait");
-            exit(1);
+        // The children take their work from the queue and leave their
+        // predictions in the result area, waking the parent as they go
+        if(verbose) {
+            printf("- Waiting for children...\n");
+            fflush(stdout);
         }
-    }
 
-    // When the children have finised, read their results from their pipe
- 
-    // TODO
-    
-    for (int i = 0; i < num_procs; i++) {
-        if (close(fds2[i][1]) == -1) {
-            perror("close fds2");
-            exit(1);
-        }
-        int value;
-        if (read(fds2[i][0], &value, sizeof(int)) == -1) {
-            perror("read fds2");
-            exit(1);
-        }
-        total_correct += value;
-        if (close(fds2[i][0]) == -1) {
-            perror("close fds2");
-            exit(1);
-        }
+        // TODO
+        total_correct = wait_for_results(results, num_procs, verbose);
     }
 
+    PredictionRecord *records = result_records(results);
+    if (predictions_file != NULL) {
+        write_predictions(predictions_file, testing, records);
+    }
 
     if(verbose) {
+        print_work_stats(queue);
+        print_confusion_matrix(testing, records);
         printf("Number of correct predictions: %d\n", total_correct);
     }
 
@@ -285,6 +559,10 @@ int main(int argc, char *argv[]) {
     // free my stuff
 
     // TODO
+    free_result_area(results);
+    free_work_queue(queue);
+    free_placement(placement);
+    free_projection(projection);
     free_dataset(training);
     free_dataset(testing);
 
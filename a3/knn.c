@@ -1,14 +1,110 @@
+#define _GNU_SOURCE  // For CPU_SET and pthread_attr_setaffinity_np
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <math.h>    
+#include <limits.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "knn.h"
 
 /****************************************************************************/
 /* For all the remaining functions you may assume all the images are of the */
 /*     same size, you do not need to perform checks to ensure this.         */
 /****************************************************************************/
+/* Map the dataset file filename read-only, storing the number of images in
+ * *num_items and the length of the mapping in *size. Return NULL if the
+ * file does not exist.
+ */
+static unsigned char *map_dataset_file(const char *filename, int *num_items, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    if (read(fd, num_items, sizeof(int)) != sizeof(int)) {
+        fprintf(stderr, "Could not read num items from %s\n", filename);
+        exit(1);
+    }
+    *size = sizeof(int) + (size_t)*num_items * RECORD_SIZE;
+    if (*num_items < 0 || (size_t)st.st_size < *size) {
+        fprintf(stderr, "Error: %s is too short for %d images\n", filename, *num_items);
+        exit(1);
+    }
+
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    unsigned char *map = mmap(NULL, *size, PROT_READ, flags, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (madvise(map, *size, MADV_WILLNEED) == -1) {
+        perror("madvise");
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    return map;
+}
+
+/* Return the dot product of the NUM_PIXELS pixels a and b. The sum is exact:
+ * it is at most 255 * 255 * NUM_PIXELS.
+ */
+__attribute__((optimize("tree-vectorize"), target_clones("avx2", "default")))
+static unsigned int dot_pixels(const unsigned char *a, const unsigned char *b) {
+    unsigned int sum = 0;
+    for (int i = 0; i < NUM_PIXELS; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+/* Allocate a Dataset of num_items images whose pixels are yet to be set.
+ */
+static Dataset *new_dataset(int num_items) {
+    Dataset *data = malloc(sizeof(Dataset));
+    data->num_items = num_items;
+    data->map = NULL;
+    data->map_size = 0;
+    data->slab = NULL;
+    data->bits = NULL;
+    data->vptree = NULL;
+    data->hnsw = NULL;
+    data->proj = NULL;
+    data->proj_stride = 0;
+    for (int k = 0; k < NUM_BLOCKS; k++) {
+        data->block_order[k] = k;
+    }
+    data->labels = malloc(sizeof(unsigned char) * num_items);
+    data->images = malloc(sizeof(Image) * num_items);
+    for (int i = 0; i < num_items; i++) {
+        data->images[i].sx = WIDTH;
+        data->images[i].sy = WIDTH;
+        data->images[i].bits = NULL;
+        data->images[i].proj = NULL;
+    }
+    return data;
+}
+
 /**
  * load_dataset takes the name of the binary file containing the data and
  * loads it into memory. The binary file format consists of the following:
@@ -20,41 +116,69 @@
  *     -   1 byte  : Image N label
  *     - 784 bytes : Image N data (WIDTHxWIDTH)
  *
+ * The file is memory-mapped rather than read: each image's data points at
+ * its pixels inside the mapping (records are a fixed RECORD_SIZE bytes
+ * apart), so the pixels must not be modified.
+ *
  * If the filename does not exist then the function will return a NULL pointer.
  */
 Dataset *load_dataset(const char *filename) {
-    Dataset *data = malloc(sizeof(Dataset));
-
-    FILE *f = fopen(filename, "rb");
-    if(f == NULL) {
+    int num_items;
+    size_t size;
+    unsigned char *map = map_dataset_file(filename, &num_items, &size);
+    if (map == NULL) {
         return NULL;
     }
-    if(fread(&data->num_items, sizeof(int), 1, f)==-1){
-        fprintf(stderr, "Could not read num items from %s\n", filename);
-        exit(1);
-    }
-
-    data->labels = malloc(sizeof(unsigned char) * data->num_items);
-    data->images = malloc(sizeof(Image) * data->num_items);
 
-    for (int i = 0; i < data->num_items; i++) {
-        if(fread(data->labels + i, sizeof(unsigned char), 1, f) != 1) {
-            fprintf(stderr, "Error: expecting to read a label from %s\n", filename);
-            exit(1);
-        }
-        data->images[i].sx = WIDTH;
-        data->images[i].sy = WIDTH;
+    // Point the images straight into the mapping; its pages are shared
+    // with any children forked after loading
+    Dataset *data = new_dataset(num_items);
+    data->map = map;
+    data->map_size = size;
+    unsigned char *record = map + sizeof(int);
+    for (int i = 0; i < num_items; i++, record += RECORD_SIZE) {
+        data->labels[i] = record[0];
+        data->images[i].data = record + 1;
+        data->images[i].sqnorm = dot_pixels(record + 1, record + 1);
+    }
+    return data;
+}
 
-        data->images[i].data = malloc(sizeof(unsigned char) * NUM_PIXELS);
-        if(fread(data->images[i].data, sizeof(unsigned char), NUM_PIXELS, f) != NUM_PIXELS) {
-            fprintf(stderr, "Error: expecting to read the pixels from image %d\n", i);
-            exit(1);
-        }
+/**
+ * Load the binary file filename, in the same format as for load_dataset,
+ * into a single SLAB_ALIGN-aligned slab of pixels instead: the pixels of
+ * image i are at dataset_pixels(data, i) == data->slab + i * SLAB_STRIDE,
+ * followed by zeros up to the next row. Each image's data also points at
+ * its row, so everything that works on a Dataset works on either layout.
+ *
+ * If the filename does not exist then the function will return a NULL pointer.
+ */
+Dataset *load_dataset_slab(const char *filename) {
+    int num_items;
+    size_t size;
+    unsigned char *map = map_dataset_file(filename, &num_items, &size);
+    if (map == NULL) {
+        return NULL;
     }
-    if(fclose(f) != 0) {
-        perror("fclose");
+
+    Dataset *data = new_dataset(num_items);
+    size_t slab_size = (size_t)num_items * SLAB_STRIDE;
+    if (posix_memalign((void **)&data->slab, SLAB_ALIGN, slab_size > 0 ? slab_size : SLAB_ALIGN) != 0) {
+        fprintf(stderr, "Could not allocate the pixels of %s\n", filename);
         exit(1);
     }
+    unsigned char *record = map + sizeof(int);
+    for (int i = 0; i < num_items; i++, record += RECORD_SIZE) {
+        unsigned char *row = data->slab + (size_t)i * SLAB_STRIDE;
+        data->labels[i] = record[0];
+        memcpy(row, record + 1, NUM_PIXELS);
+        memset(row + NUM_PIXELS, 0, SLAB_STRIDE - NUM_PIXELS);
+        data->images[i].data = row;
+        data->images[i].sqnorm = dot_pixels(row, row);
+    }
+    if (munmap(map, size) == -1) {
+        perror("munmap");
+    }
     return data;
 }
 
@@ -71,151 +195,2717 @@ double distance_euclidean(Image *a, Image *b) {
     return sqrt(d);
 }
 
+/* The euclidean search in knn_predict compares the pixels one block at a
+ * time, visiting the blocks in the block_order of the training set, and
+ * abandons a candidate as soon as its partial sum shows it cannot be one
+ * of the K nearest. Visiting the blocks where images differ most first
+ * (see order_blocks_by_variance) rejects most candidates after a few
+ * blocks.
+ */
+_Static_assert(NUM_BLOCKS * BLOCK_PIXELS <= SLAB_STRIDE, "slab rows must hold whole blocks");
+
+// Pixels compared and pixels skipped by the euclidean search so far
+static long long pixels_compared, pixels_skipped;
+
+/**
+ * Make knn_predict visit the pixel blocks in decreasing order of the
+ * variance of their pixels over the images in data when it searches data.
+ * This only changes how quickly far away images are rejected, never the
+ * result.
+ */
+void order_blocks_by_variance(Dataset *data) {
+    if (data->num_items == 0) {
+        return;
+    }
+    double score[NUM_BLOCKS] = {0};
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        long long sum = 0, sum_sq = 0;
+        for (int i = 0; i < data->num_items; i++) {
+            int value = dataset_pixels(data, i)[p];
+            sum += value;
+            sum_sq += value * value;
+        }
+        double mean = (double)sum / data->num_items;
+        score[p / BLOCK_PIXELS] += (double)sum_sq / data->num_items - mean * mean;
+    }
+    int order[NUM_BLOCKS];
+    for (int k = 0; k < NUM_BLOCKS; k++) {
+        // Average per pixel, since the last block may be short
+        int start = k * BLOCK_PIXELS;
+        int stop = start + BLOCK_PIXELS < NUM_PIXELS ? start + BLOCK_PIXELS : NUM_PIXELS;
+        score[k] /= stop - start;
+        // Insertion sort by decreasing score, ties in block order
+        int j = k;
+        while (j > 0 && score[order[j - 1]] < score[k]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = k;
+    }
+    memcpy(data->block_order, order, sizeof(order));
+}
+
+/**
+ * Store in *compared and *skipped the number of pixel comparisons the
+ * euclidean search in knn_predict has done and skipped (because the
+ * candidate was abandoned early) in this process so far.
+ */
+void knn_pixel_stats(long long *compared, long long *skipped) {
+    *compared = __atomic_load_n(&pixels_compared, __ATOMIC_RELAXED);
+    *skipped = __atomic_load_n(&pixels_skipped, __ATOMIC_RELAXED);
+}
+
+/* Squared euclidean distance between the NUM_PIXELS pixels a and b, except
+ * that once the partial sum reaches bound the remaining blocks are skipped
+ * and the partial sum (which is then at least bound) is returned. The
+ * blocks are visited in the order given by order, and the number of pixels
+ * compared is added to *compared.
+ */
+static unsigned int distance_sq_bounded(unsigned char *a, unsigned char *b,
+                                        unsigned int bound, const int *order,
+                                        long long *compared) {
+    unsigned int sum = 0;
+    for (int k = 0; k < NUM_BLOCKS && sum < bound; k++) {
+        int start = order[k] * BLOCK_PIXELS;
+        int stop = start + BLOCK_PIXELS < NUM_PIXELS ? start + BLOCK_PIXELS : NUM_PIXELS;
+        for (int i = start; i < stop; i++) {
+            int d = a[i] - b[i];
+            sum += d * d;
+        }
+        *compared += stop - start;
+    }
+    return sum;
+}
+
+/* distance_sq_bounded for two SLAB_STRIDE rows of a slab (or of a copy of
+ * the input padded the same way). Every block is whole, and zero in both
+ * past NUM_PIXELS, so the inner loop has a fixed length and aligned rows
+ * and is vectorised, with an AVX2 version picked at load time if the CPU
+ * has it.
+ */
+__attribute__((optimize("tree-vectorize"), target_clones("avx2", "default")))
+static unsigned int distance_sq_bounded_rows(const unsigned char *a, const unsigned char *b,
+                                             unsigned int bound, const int *order,
+                                             long long *compared) {
+    a = __builtin_assume_aligned(a, SLAB_ALIGN);
+    b = __builtin_assume_aligned(b, SLAB_ALIGN);
+    unsigned int sum = 0;
+    for (int k = 0; k < NUM_BLOCKS && sum < bound; k++) {
+        int start = order[k] * BLOCK_PIXELS;
+        unsigned int block = 0;
+        for (int i = start; i < start + BLOCK_PIXELS; i++) {
+            int d = a[i] - b[i];
+            block += d * d;
+        }
+        sum += block;
+        *compared += start + BLOCK_PIXELS < NUM_PIXELS ? BLOCK_PIXELS : NUM_PIXELS - start;
+    }
+    return sum;
+}
+
+/* The cosine of the angle between two images, given their dot product and
+ * sums of squares. It is NAN if either is all zeros.
+ */
+static double cosine_similarity(double dot, double sqnorm_a, double sqnorm_b) {
+    return dot / (sqrt(sqnorm_a) * sqrt(sqnorm_b));
+}
+
+/* The cosine distance (see distance_cosine) for the cosine similarity sim.
+ * It decreases as sim increases.
+ */
+static double cosine_to_distance(double sim) {
+    return (2 / M_PI) * acos(sim);
+}
+
+/* Hamming distance kernels for two rows of BIT_WORDS words: the number of
+ * bits that differ. The generic one uses the popcnt instruction if the CPU
+ * has it; with AVX-512 VPOPCNTQ all 13 words are counted in two
+ * instructions. hamming_words points at the best one for this CPU, picked
+ * on the first call.
+ */
+__attribute__((target_clones("popcnt", "default")))
+static unsigned int hamming_words_generic(const unsigned long long *a,
+                                          const unsigned long long *b) {
+    unsigned int d = 0;
+    for (int i = 0; i < BIT_WORDS; i++) {
+        d += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return d;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+_Static_assert(BIT_WORDS > 8 && BIT_WORDS <= 16, "the AVX-512 kernel counts two vectors");
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static unsigned int hamming_words_avx512(const unsigned long long *a,
+                                         const unsigned long long *b) {
+    __mmask8 tail = (1 << (BIT_WORDS - 8)) - 1;
+    __m512i lo = _mm512_xor_si512(_mm512_loadu_si512(a), _mm512_loadu_si512(b));
+    __m512i hi = _mm512_xor_si512(_mm512_maskz_loadu_epi64(tail, a + 8),
+                                  _mm512_maskz_loadu_epi64(tail, b + 8));
+    return _mm512_reduce_add_epi64(_mm512_add_epi64(_mm512_popcnt_epi64(lo),
+                                                    _mm512_popcnt_epi64(hi)));
+}
+#endif
+
+static unsigned int hamming_words_resolve(const unsigned long long *a,
+                                          const unsigned long long *b);
+static unsigned int (*hamming_words)(const unsigned long long *, const unsigned long long *) =
+    hamming_words_resolve;
+
+static unsigned int hamming_words_resolve(const unsigned long long *a,
+                                          const unsigned long long *b) {
+    unsigned int (*impl)(const unsigned long long *, const unsigned long long *) =
+        hamming_words_generic;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+        impl = hamming_words_avx512;
+    }
+#endif
+    __atomic_store_n(&hamming_words, impl, __ATOMIC_RELAXED);
+    return impl(a, b);
+}
+
+/* Return the squared euclidean distance between the projected images a and
+ * b, rows of stride floats (a multiple of PROJ_LANES, zero past the last
+ * dimension). Summing into PROJ_LANES separate lanes lets the loop be
+ * vectorised without reassociating the float additions.
+ */
+__attribute__((optimize("tree-vectorize"), target_clones("avx2", "default")))
+static float distance_sq_floats(const float *a, const float *b, int stride) {
+    float lanes[PROJ_LANES] = {0};
+    for (int i = 0; i < stride; i += PROJ_LANES) {
+        for (int j = 0; j < PROJ_LANES; j++) {
+            float d = a[i + j] - b[i + j];
+            lanes[j] += d * d;
+        }
+    }
+    float sum = 0;
+    for (int j = 0; j < PROJ_LANES; j++) {
+        sum += lanes[j];
+    }
+    return sum;
+}
+
+/* Manhattan and chebyshev kernels for n pixels of a and b: the sum and the
+ * largest of the absolute differences. They are always inlined, so that in
+ * the scans (see DEFINE_PIXEL_SCAN) n is a constant and the loops are
+ * vectorised.
+ */
+static inline __attribute__((always_inline))
+unsigned int manhattan_pixels(const unsigned char *a, const unsigned char *b, int n) {
+    unsigned int sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += abs(a[i] - b[i]);
+    }
+    return sum;
+}
+
+static inline __attribute__((always_inline))
+unsigned int chebyshev_pixels(const unsigned char *a, const unsigned char *b, int n) {
+    unsigned char max = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned char d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        max = d > max ? d : max;
+    }
+    return max;
+}
+
 typedef struct {
     double dist;
     int img_idx;
+    int slot;       // Slot in the original scan's array (see Knn_heap)
 } Knn_item;
 
-/**
- * Given the input training dataset, an image to classify and K as well as a 
- * distance function specified by fptr,
- *   (1) Find the K most similar images to `input` in the dataset
- *   (2) Return the most frequent label of these K images.  If two are tied, 
- *       output the smaller label.
- */ 
-int knn_predict(Dataset *data, Image *input, int K, double (*fptr)(Image *, Image *)) {
+/* A bounded max-heap holding the (at most) K nearest images seen so far.
+ * The root is the worst of them, so deciding whether a new image belongs
+ * in the set is O(1) and replacing the worst one is O(log K).
+ *
+ * It keeps the same images as the original scan, which held them in an
+ * array of K slots, filled the slots in order and then replaced the image
+ * in the first of the farthest slots whenever one strictly closer came
+ * along. So each image remembers its slot, a newcomer takes the slot of
+ * the image it replaces, and in the heap images are ordered by distance
+ * and then by slot, the lower slot being the worse of two at the same
+ * distance. Images at an infinite or NAN distance are never kept.
+ */
+typedef struct {
+    Knn_item *items;
+    int size;
+    int capacity;
+    Knn_item *log;  // If not NULL, every image that gets in is added here too
+    int logged;     // Images in log
+} Knn_heap;
 
-    // Array to keep track of K-closest images so far.
-    Knn_item smallest[K];
-    for (int i = 0; i < K; i++) {
-        smallest[i].dist = INFINITY;
+/* Order images by distance and then by index: 1 if a comes after b. */
+static int knn_item_after(Knn_item *a, Knn_item *b) {
+    return a->dist > b->dist || (a->dist == b->dist && a->img_idx > b->img_idx);
+}
+
+/* The order of a Knn_heap: 1 if a is worse than b. */
+static int knn_heap_after(Knn_item *a, Knn_item *b) {
+    return a->dist > b->dist || (a->dist == b->dist && a->slot < b->slot);
+}
+
+static void knn_heap_sift_down(Knn_heap *h, int i) {
+    Knn_item item = h->items[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= h->size) {
+            break;
+        }
+        if (child + 1 < h->size && knn_heap_after(&h->items[child + 1], &h->items[child])) {
+            child++;
+        }
+        if (!knn_heap_after(&h->items[child], &item)) {
+            break;
+        }
+        h->items[i] = h->items[child];
+        i = child;
     }
-    // For each training image, compute the distance using the function pointer
-    for (int i = 0; i < data->num_items; i++) {
-        
-        // TODO Change the call below to call distance function passed in as
-        // a parameter
-        double dist = fptr(&data->images[i], input);
-        // double dist = distance_euclidean(&data->images[i], input);
+    h->items[i] = item;
+}
 
-        // Find the maximum distance among the previous K closest
-        double max_dist = -1;
-        int max_index = 0;
-        for (int j = 0; j < K; j++) {
-            if (smallest[j].dist > max_dist) {
-                max_dist = smallest[j].dist;
-                max_index = j;
-            }
+/* Offer image img_idx at distance dist to the heap.
+ */
+static void knn_heap_offer(Knn_heap *h, double dist, int img_idx) {
+    Knn_item item = {dist, img_idx, h->size};
+    if (!(dist < INFINITY)) {
+        return;
+    }
+    if (h->size < h->capacity) {
+        int i = h->size++;
+        while (i > 0 && knn_heap_after(&item, &h->items[(i - 1) / 2])) {
+            h->items[i] = h->items[(i - 1) / 2];
+            i = (i - 1) / 2;
         }
+        h->items[i] = item;
+    } else if (h->capacity > 0 && dist < h->items[0].dist) {
+        item.slot = h->items[0].slot;
+        h->items[0] = item;
+        knn_heap_sift_down(h, 0);
+    } else {
+        return;
+    }
+    if (h->log != NULL) {
+        h->log[h->logged++] = item;
+    }
+}
 
-        // If current distance one of K-closest so far, update the values.
-        if (dist < max_dist) {
-            smallest[max_index].dist = dist;
-            smallest[max_index].img_idx = i;
-        }    
+/* Return the distance by fptr from image img_idx of data to input, computed
+ * the way knn_predict's scans would (so the value is the same) but with the
+ * fastest kernel there is for it. The sqnorm of input must be set (see
+ * knn_search). If heap is not NULL, the euclidean distance is abandoned
+ * (INFINITY is returned) as soon as it is clear the image is further than
+ * the worst one in the heap; one just as far is still returned, so ties
+ * with it can be seen.
+ */
+static double metric_distance(double (*fptr)(Image *, Image *), Dataset *data, int img_idx,
+                              Image *input, Knn_heap *heap) {
+    Image *image = &data->images[img_idx];
+    if (fptr == distance_euclidean && input->sx * input->sy == NUM_PIXELS) {
+        if (heap == NULL || heap->size < heap->capacity || heap->capacity == 0) {
+            // The exact sum, from the cached norms and one vectorised pass
+            return sqrt(image->sqnorm + input->sqnorm -
+                        2 * dot_pixels(dataset_pixels(data, img_idx), input->data));
+        }
+        unsigned int bound = (unsigned int)llround(heap->items[0].dist * heap->items[0].dist);
+        long long compared = 0;
+        unsigned int sq = distance_sq_bounded(dataset_pixels(data, img_idx), input->data,
+                                              bound + 1, data->block_order, &compared);
+        return sq <= bound ? sqrt(sq) : INFINITY;
+    }
+    if (fptr == distance_cosine && input->sx * input->sy == NUM_PIXELS) {
+        // Just the dot product, the norms being cached
+        unsigned int dot = dot_pixels(dataset_pixels(data, img_idx), input->data);
+        return cosine_to_distance(cosine_similarity(dot, image->sqnorm, input->sqnorm));
+    }
+    if (fptr == distance_hamming && image->bits != NULL && input->bits != NULL) {
+        return hamming_words(image->bits, input->bits);
+    }
+    if (fptr == distance_manhattan && input->sx * input->sy == NUM_PIXELS) {
+        return manhattan_pixels(dataset_pixels(data, img_idx), input->data, NUM_PIXELS);
     }
+    if (fptr == distance_chebyshev && input->sx * input->sy == NUM_PIXELS) {
+        return chebyshev_pixels(dataset_pixels(data, img_idx), input->data, NUM_PIXELS);
+    }
+    return fptr(image, input);
+}
 
-    // Count the frequencies of the labels
-    int counts[10] = {0};
-    for (int i = 0; i < K; i++) {
-        counts[data->labels[smallest[i].img_idx]]++;
+/* An exact vantage-point tree over the images of a Dataset, for the metric
+ * fptr. Each inner node has a vantage point image vp: the images below it
+ * whose distance from vp is at most radius are under inside, the others
+ * (at least radius away) under outside. By the triangle inequality a query
+ * at distance d from vp is at least d - radius from everything inside and
+ * at least radius - d from everything outside, so a whole subtree can be
+ * skipped when that is further than the worst of the K nearest so far.
+ * Small subtrees are leaves that list their images.
+ *
+ * The nodes and the leaf lists are flat arrays so the tree can be saved
+ * to disk as is.
+ */
+#define VP_LEAF_SIZE 8
+
+/* Distances are rounded, so the triangle inequality may be off by a few
+ * units in the last place; a subtree is only skipped if it is further away
+ * than this (relative) margin too.
+ */
+#define VP_SLACK 1e-9
+
+typedef struct {
+    int vp;         // Vantage point image, or -1 for a leaf
+    double radius;  // Median distance from vp of the images below
+    int inside;     // Node of the images within radius of vp, or -1
+    int outside;    // Node of the images at least radius from vp, or -1
+    int first;      // Leaf: its images are items[first] .. items[first + count - 1]
+    int count;
+} VpNode;
+
+struct VpTree {
+    double (*fptr)(Image *, Image *);  // The metric the tree was built for
+    int num_nodes;
+    VpNode *nodes;
+    int num_items;
+    int *items;                        // Every image, leaf lists in order
+};
+
+// Distances computed by vptree searches, and the images searched
+static long long vptree_computed, vptree_searched;
+
+typedef struct {
+    double key;
+    int img_idx;
+} VpKey;
+
+static int vp_key_compare(const void *a, const void *b) {
+    const VpKey *x = a, *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
     }
-    
-    // Find the most frequent label
-    int max_count = 0, max_label = 1;
-    for (int i = 0; i < 10; i++) {
-        if (counts[i] > max_count) {
-            max_count = counts[i];
-            max_label = i;
-        }
+    return x->img_idx - y->img_idx;
+}
+
+/* Build the subtree over the images items[lo] .. items[hi - 1] (reordering
+ * them) and return its node.
+ */
+static int vptree_build_node(struct VpTree *tree, Dataset *data, int lo, int hi,
+                             VpKey *keys, unsigned int *seed) {
+    int id = tree->num_nodes++;
+    VpNode *node = &tree->nodes[id];
+    int n = hi - lo;
+    if (n <= VP_LEAF_SIZE) {
+        *node = (VpNode){-1, 0, -1, -1, lo, n};
+        return id;
     }
 
-    return max_label;
+    // Move a random vantage point to the front and sort the rest by their
+    // distance from it. A NAN distance (the cosine of a blank image, or of
+    // one pointing the same way as vp) is taken as 0.
+    int pick = lo + rand_r(seed) % n;
+    int vp = tree->items[pick];
+    tree->items[pick] = tree->items[lo];
+    tree->items[lo] = vp;
+    for (int i = lo + 1; i < hi; i++) {
+        double d = metric_distance(tree->fptr, data, tree->items[i], &data->images[vp], NULL);
+        keys[i - lo - 1] = (VpKey){d == d ? d : 0, tree->items[i]};
+    }
+    qsort(keys, n - 1, sizeof(VpKey), vp_key_compare);
+    for (int i = lo + 1; i < hi; i++) {
+        tree->items[i] = keys[i - lo - 1].img_idx;
+    }
+    int mid = lo + 1 + (n - 1) / 2;
+    double radius = keys[(n - 1) / 2 - 1].key;
+
+    int inside = vptree_build_node(tree, data, lo + 1, mid, keys, seed);
+    int outside = vptree_build_node(tree, data, mid, hi, keys, seed);
+    tree->nodes[id] = (VpNode){vp, radius, inside, outside, 0, 0};
+    return id;
 }
 
-/** 
- * Free all the allocated memory for the dataset
- * Check to ensure that the function works properly when `data' is allocated
- * as well as when `data' is not allocated.
+
+/* Offer image img_idx at distance dist to the heap (of at least one image)
+ * like knn_heap_offer, keeping in *tied the number of images offered so far
+ * that are not in the heap but are as near as the worst one in it.
  */
-void free_dataset(Dataset *data) {
-    if (data == NULL) {
+static void vptree_offer(Knn_heap *heap, double dist, int img_idx, int *tied) {
+    if (heap->size < heap->capacity) {
+        knn_heap_offer(heap, dist, img_idx);
         return;
     }
-
-    for (int i = 0; i < data->num_items; i++) {
-        free(data->images[i].data);
+    double worst = heap->items[0].dist;
+    if (dist == worst) {
+        (*tied)++;
+    } else if (dist < worst) {
+        // The image put out is tied with the new worst one if that is just
+        // as far, and the earlier ties with it are too; if not, none are
+        knn_heap_offer(heap, dist, img_idx);
+        *tied = heap->items[0].dist == worst ? *tied + 1 : 0;
     }
-    free(data->images);
-    free(data->labels);
-    free(data);
 }
 
+/* Offer every image in the subtree under node that could be one of the K
+ * nearest to input to the heap, counting in *tied those left out of it at
+ * the K-th distance (see vptree_offer). Images are offered out of index
+ * order, so if any are the heap may keep different ones of the tied
+ * images than the scan does; if none are, it holds the same K images.
+ */
+static void vptree_search(struct VpTree *tree, int id, Dataset *data, Image *input,
+                          Knn_heap *heap, int *tied, long long *computed) {
+    VpNode *node = &tree->nodes[id];
+    if (node->vp == -1) {
+        for (int i = node->first; i < node->first + node->count; i++) {
+            int img_idx = tree->items[i];
+            vptree_offer(heap, metric_distance(tree->fptr, data, img_idx, input, heap), img_idx,
+                         tied);
+        }
+        *computed += node->count;
+        return;
+    }
+
+    double d = metric_distance(tree->fptr, data, node->vp, input, NULL);
+    vptree_offer(heap, d, node->vp, tied);
+    (*computed)++;
 
+    // Search the side the input is on first, as it tightens the bound most
+    int near = d <= node->radius ? node->inside : node->outside;
+    int far = d <= node->radius ? node->outside : node->inside;
+    for (int side = 0; side < 2; side++) {
+        int child = side == 0 ? near : far;
+        if (child == -1) {
+            continue;
+        }
+        // Everything in a subtree skipped is further than the worst, so no
+        // ties are missed
+        double gap = child == node->inside ? d - node->radius : node->radius - d;
+        if (heap->size == heap->capacity) {
+            double worst = heap->capacity > 0 ? heap->items[0].dist : 0;
+            if (gap - worst > VP_SLACK * (1 + d + node->radius)) {
+                continue;
+            }
+        }
+        vptree_search(tree, child, data, input, heap, tied, computed);
+    }
+}
 
-/************************** A3 Code below ************************************/
+/**
+ * Build a vantage-point tree over the images in data for the metric fptr
+ * and attach it to data (replacing any earlier one). From then on,
+ * knn_predict with the same fptr searches the tree rather than every image,
+ * with the same result (see vptree_knn). fptr must be a metric (all of
+ * those in metrics are).
+ */
+void build_vptree(Dataset *data, double (*fptr)(Image *, Image *)) {
+    free_vptree(data);
+    struct VpTree *tree = malloc(sizeof(struct VpTree));
+    tree->fptr = fptr;
+    tree->num_nodes = 0;
+    tree->num_items = data->num_items;
+    tree->nodes = malloc(sizeof(VpNode) * (data->num_items > 0 ? data->num_items : 1));
+    tree->items = malloc(sizeof(int) * (data->num_items > 0 ? data->num_items : 1));
+    VpKey *keys = malloc(sizeof(VpKey) * (data->num_items > 0 ? data->num_items : 1));
+    if (tree->nodes == NULL || tree->items == NULL || keys == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        tree->items[i] = i;
+    }
+    unsigned int seed = 209;
+    vptree_build_node(tree, data, 0, data->num_items, keys, &seed);
+    free(keys);
+    data->vptree = tree;
+}
 
 /**
- * child_handler will be called by each child process, and is where the 
- * kNN predictions happen. Along with the training and testing datasets, the
- * function also takes in 
- *    (1) File descriptor for a pipe with input coming from the parent: p_in
- *    (2) File descriptor for a pipe with output going to the parent:  p_out
- * 
- * Once this function is called, the child should do the following:
- *    - Read an integer `start_idx` from the parent (through p_in)
- *    - Read an integer `N` from the parent (through p_in)
- *    - Call `knn_predict()` on testing images `start_idx` to `start_idx+N-1`
- *    - Write an integer representing the number of correct predictions to
- *        the parent (through p_out)
+ * Free the vantage-point tree attached to data, if any.
+ */
+void free_vptree(Dataset *data) {
+    if (data->vptree == NULL) {
+        return;
+    }
+    free(data->vptree->nodes);
+    free(data->vptree->items);
+    free(data->vptree);
+    data->vptree = NULL;
+}
+
+/* Header of a saved vantage-point tree. It is only used for the same
+ * dataset file (same size and modification time) and the same metric.
  */
-void child_handler(Dataset *training, Dataset *testing, int K, 
-                   double (*fptr)(Image *, Image *), int p_in, int p_out) {
+#define VPTREE_MAGIC 0x31545056  // "VPT1"
 
-    //TODO
-    int start_idx;
-    int N;
-    if (read(p_in, &start_idx, sizeof(int)) == -1) {
-        perror("read");
-        exit(1);
+typedef struct {
+    int magic;
+    int num_items;
+    int num_nodes;
+    char metric[16];
+    long long file_size;
+    long long file_mtime;
+} VpHeader;
+
+static void vptree_header(VpHeader *h, struct stat *st, const char *metric, int num_items,
+                          int num_nodes) {
+    memset(h, 0, sizeof(VpHeader));
+    h->magic = VPTREE_MAGIC;
+    h->num_items = num_items;
+    h->num_nodes = num_nodes;
+    strncpy(h->metric, metric, sizeof(h->metric) - 1);
+    h->file_size = st->st_size;
+    h->file_mtime = st->st_mtime;
+}
+
+/* Read the tree saved in path, if it is there and its header matches
+ * expected (apart from the number of nodes), and attach it to data.
+ * Return 1 if it was loaded.
+ */
+static int load_vptree(Dataset *data, const char *path, VpHeader *expected,
+                       double (*fptr)(Image *, Image *)) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return 0;
     }
-    if (read(p_in, &N, sizeof(int)) == -1) {
-        perror("read");
-        exit(1);
+    VpHeader h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 && h.magic == expected->magic &&
+             h.num_items == expected->num_items &&
+             strncmp(h.metric, expected->metric, sizeof(h.metric)) == 0 &&
+             h.file_size == expected->file_size && h.file_mtime == expected->file_mtime &&
+             h.num_nodes > 0 && h.num_nodes <= (h.num_items > 0 ? h.num_items : 1);
+    struct VpTree *tree = malloc(sizeof(struct VpTree));
+    tree->nodes = NULL;
+    tree->items = NULL;
+    if (ok) {
+        tree->fptr = fptr;
+        tree->num_nodes = h.num_nodes;
+        tree->num_items = h.num_items;
+        tree->nodes = malloc(sizeof(VpNode) * h.num_nodes);
+        tree->items = malloc(sizeof(int) * (h.num_items > 0 ? h.num_items : 1));
+        ok = fread(tree->nodes, sizeof(VpNode), h.num_nodes, f) == (size_t)h.num_nodes &&
+             fread(tree->items, sizeof(int), h.num_items, f) == (size_t)h.num_items;
+    }
+    // Children always come after their parent, so a valid tree has no loops
+    for (int i = 0; ok && i < h.num_nodes; i++) {
+        VpNode *node = &tree->nodes[i];
+        ok = node->vp >= -1 && node->vp < h.num_items &&
+             (node->inside == -1 || (node->inside > i && node->inside < h.num_nodes)) &&
+             (node->outside == -1 || (node->outside > i && node->outside < h.num_nodes)) &&
+             node->first >= 0 && node->count >= 0 && node->first <= h.num_items - node->count;
+    }
+    for (int i = 0; ok && i < h.num_items; i++) {
+        ok = tree->items[i] >= 0 && tree->items[i] < h.num_items;
+    }
+    fclose(f);
+    if (!ok) {
+        free(tree->nodes);
+        free(tree->items);
+        free(tree);
+        return 0;
     }
+    free_vptree(data);
+    data->vptree = tree;
+    return 1;
+}
 
-    int num_correct = 0;
-    for (int i = start_idx; i < start_idx + N; i++) {
-        int prediction = knn_predict(training, &testing->images[i], K, fptr);
-        if (prediction == testing->labels[i]) {
-            num_correct += 1;
-        }
+/* Save the tree attached to data in path, through a temporary file so a
+ * concurrent reader never sees half of it.
+ */
+static void save_vptree(Dataset *data, const char *path, VpHeader *h) {
+    char tmp[strlen(path) + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        perror(tmp);
+        return;
     }
-    if (write(p_out, &num_correct, sizeof(int)) == -1) {
-        perror("write");
+    struct VpTree *tree = data->vptree;
+    int ok = fwrite(h, sizeof(VpHeader), 1, f) == 1 &&
+             fwrite(tree->nodes, sizeof(VpNode), tree->num_nodes, f) == (size_t)tree->num_nodes &&
+             fwrite(tree->items, sizeof(int), tree->num_items, f) == (size_t)tree->num_items;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) == -1) {
+        fprintf(stderr, "Could not save the index in %s\n", path);
+        unlink(tmp);
+    }
+}
+
+/**
+ * Attach a vantage-point tree for the metric fptr, called metric, to data,
+ * which was loaded from filename. The tree is read from
+ * "<filename>.<metric>.vpt" if it was saved there for this version of the
+ * file; otherwise it is built with build_vptree and saved there, so the
+ * next run does not have to. Return 1 if the tree was read from disk.
+ */
+int attach_vptree(Dataset *data, const char *filename, double (*fptr)(Image *, Image *),
+                  const char *metric) {
+    struct stat st;
+    if (stat(filename, &st) == -1) {
+        perror(filename);
         exit(1);
     }
+    char path[strlen(filename) + strlen(metric) + 8];
+    snprintf(path, sizeof(path), "%s.%s.vpt", filename, metric);
+
+    VpHeader h;
+    vptree_header(&h, &st, metric, data->num_items, 0);
+    if (load_vptree(data, path, &h, fptr)) {
+        return 1;
+    }
+    build_vptree(data, fptr);
+    h.num_nodes = data->vptree->num_nodes;
+    save_vptree(data, path, &h);
+    return 0;
 }
 
 /**
- * This function computes the cosine distance.  It should be called similarly to
- * the function distance() above except the formula that it should evaluate is
- * distance = 2*arccos( sum(a[i]*b[i]) / (sqrt(sum(a[i]^2) sqrt(sum(b[i]^2)))/pi
- * See (https://en.wikipedia.org/wiki/Cosine_similarity) for more information.
- *   - use the constant M_PI for pi.  M_PI is defined in math.h
- *   - "man acos" describes the arc cos funciton in the C math library
-*/
-double distance_cosine(Image *a, Image *b) {
+ * Store in *computed the number of distances computed by knn_predict
+ * searches of vantage-point trees in this process so far, and in *searched
+ * the number a linear scan would have computed.
+ */
+void knn_vptree_stats(long long *computed, long long *searched) {
+    *computed = __atomic_load_n(&vptree_computed, __ATOMIC_RELAXED);
+    *searched = __atomic_load_n(&vptree_searched, __ATOMIC_RELAXED);
+}
 
-    //TODO
-    double d1 = 0;
-    double d2 = 0;
-    double d3 = 0;
+/* An approximate index over the images of a Dataset: a hierarchical
+ * navigable small world graph (Malkov and Yashunin). Every image is a node
+ * on layer 0, and on each layer up to a random level (above l with
+ * probability M^-l), where it is linked to up to M (2M on layer 0) nodes
+ * near it. A search descends greedily from the entry node on the top layer
+ * to the nearest node it can find on layer 1, then does a best first search
+ * of layer 0 that keeps the ef nearest nodes it has seen.
+ *
+ * Unlike the vantage-point tree the search can miss some of the nearest
+ * images, fewer the larger ef (and M) is, so it is only used when asked for.
+ * All zero images are at a NAN cosine distance from everything, so could
+ * never be neighbours; for cosine they are left out of the graph.
+ */
+#define HNSW_EF_CONSTRUCTION 100
 
-    for (int i = 0; i < a->sx * a->sy; i++) {
-        d1 += (a->data[i] * b->data[i]);
-        d2 += a->data[i] * a->data[i];
-        d3 += b->data[i] * b->data[i];
+struct Hnsw {
+    double (*fptr)(Image *, Image *);  // Metric the graph was built for
+    int M;              // Most links of a node on the layers above 0
+    int ef;             // Nodes a search of layer 0 keeps (at least K)
+    int num_items;
+    int max_level;      // Top layer, where the entry node is alone
+    int entry;          // Node every search starts at, or -1 if empty
+    int *levels;        // Top layer of each node, or -1 if left out
+    int *layer0;        // Per node, 1 + 2M ints: the number of links, then them
+    int **upper;        // Per node, levels[i] blocks of 1 + M ints, or NULL
+};
+
+/* Scratch space of the searches, per thread: the search each node was last
+ * visited in, and a min-heap of the nodes still to expand.
+ */
+static __thread unsigned int *hnsw_visited;
+static __thread int hnsw_visited_size;
+static __thread unsigned int hnsw_epoch;
+static __thread Knn_item *hnsw_queue;
+static __thread int hnsw_queue_capacity;
+
+/* Return the links of node on layer: their number, followed by them.
+ */
+static int *hnsw_links(struct Hnsw *g, int node, int layer) {
+    if (layer == 0) {
+        return g->layer0 + (size_t)node * (1 + 2 * g->M);
     }
-return (2/M_PI)*(acos(d1/(sqrt(d2)*sqrt(d3))));
+    return g->upper[node] + (size_t)(layer - 1) * (1 + g->M);
+}
+
+/* Start a new search of a graph of num_items nodes, none of them visited.
+ */
+static void hnsw_new_search(int num_items) {
+    if (hnsw_visited_size < num_items) {
+        free(hnsw_visited);
+        hnsw_visited = calloc(num_items, sizeof(unsigned int));
+        if (hnsw_visited == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        hnsw_visited_size = num_items;
+        hnsw_epoch = 0;
+    }
+    if (++hnsw_epoch == 0) {
+        memset(hnsw_visited, 0, sizeof(unsigned int) * hnsw_visited_size);
+        hnsw_epoch = 1;
+    }
+}
+
+static int knn_item_compare(const void *a, const void *b) {
+    return knn_item_after((Knn_item *)a, (Knn_item *)b) - knn_item_after((Knn_item *)b, (Knn_item *)a);
+}
+
+static void hnsw_queue_push(int *size, Knn_item item) {
+    if (*size == hnsw_queue_capacity) {
+        hnsw_queue_capacity = hnsw_queue_capacity > 0 ? 2 * hnsw_queue_capacity : 256;
+        hnsw_queue = realloc(hnsw_queue, sizeof(Knn_item) * hnsw_queue_capacity);
+        if (hnsw_queue == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    int i = (*size)++;
+    while (i > 0 && knn_item_after(&hnsw_queue[(i - 1) / 2], &item)) {
+        hnsw_queue[i] = hnsw_queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    hnsw_queue[i] = item;
+}
+
+static Knn_item hnsw_queue_pop(int *size) {
+    Knn_item top = hnsw_queue[0];
+    Knn_item last = hnsw_queue[--(*size)];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= *size) {
+            break;
+        }
+        if (child + 1 < *size && knn_item_after(&hnsw_queue[child], &hnsw_queue[child + 1])) {
+            child++;
+        }
+        if (!knn_item_after(&last, &hnsw_queue[child])) {
+            break;
+        }
+        hnsw_queue[i] = hnsw_queue[child];
+        i = child;
+    }
+    hnsw_queue[i] = last;
+    return top;
+}
+
+/* Best first search of layer for the nodes nearest to input, starting from
+ * the num_entries nodes entries. The nearest W->capacity nodes found are
+ * left in W. hnsw_new_search must have been called first.
+ */
+static void hnsw_search_layer(struct Hnsw *g, Dataset *data, Image *input, int *entries,
+                              int num_entries, int layer, Knn_heap *W) {
+    int queued = 0;
+    for (int i = 0; i < num_entries; i++) {
+        int e = entries[i];
+        if (hnsw_visited[e] == hnsw_epoch) {
+            continue;
+        }
+        hnsw_visited[e] = hnsw_epoch;
+        double d = metric_distance(g->fptr, data, e, input, NULL);
+        knn_heap_offer(W, d, e);
+        // An entry at a NAN distance is still expanded, last
+        Knn_item item = {d < INFINITY ? d : INFINITY, e};
+        hnsw_queue_push(&queued, item);
+    }
+    while (queued > 0) {
+        Knn_item c = hnsw_queue_pop(&queued);
+        if (W->size == W->capacity && knn_item_after(&c, &W->items[0])) {
+            break;
+        }
+        int *links = hnsw_links(g, c.img_idx, layer);
+        for (int j = 1; j <= links[0]; j++) {
+            int e = links[j];
+            if (hnsw_visited[e] == hnsw_epoch) {
+                continue;
+            }
+            hnsw_visited[e] = hnsw_epoch;
+            Knn_item item = {metric_distance(g->fptr, data, e, input, W), e};
+            if (item.dist < INFINITY &&
+                (W->size < W->capacity || knn_item_after(&W->items[0], &item))) {
+                knn_heap_offer(W, item.dist, e);
+                hnsw_queue_push(&queued, item);
+            }
+        }
+    }
+}
+
+/* Choose at most max of the num candidates, sorted nearest first by their
+ * distance from a node, as its links: each one that is nearer to the node
+ * than to all those chosen before it (so the links spread out in every
+ * direction), then the nearest of the others to make up the number. The
+ * chosen ones are moved to the front of candidates; return how many.
+ */
+static int hnsw_select(struct Hnsw *g, Dataset *data, Knn_item *candidates, int num, int max) {
+    Knn_item pruned[num > 0 ? num : 1];
+    int kept = 0, num_pruned = 0;
+    for (int i = 0; i < num && kept < max; i++) {
+        int spread = 1;
+        for (int j = 0; j < kept && spread; j++) {
+            spread = metric_distance(g->fptr, data, candidates[i].img_idx,
+                                     &data->images[candidates[j].img_idx], NULL) >
+                     candidates[i].dist;
+        }
+        if (spread) {
+            candidates[kept++] = candidates[i];
+        } else {
+            pruned[num_pruned++] = candidates[i];
+        }
+    }
+    for (int i = 0; i < num_pruned && kept < max; i++) {
+        candidates[kept++] = pruned[i];
+    }
+    return kept;
+}
+
+/* Link node to other on layer, choosing again which links node keeps if it
+ * already has as many as it can.
+ */
+static void hnsw_link(struct Hnsw *g, Dataset *data, int node, int layer, int other) {
+    int max = layer == 0 ? 2 * g->M : g->M;
+    int *links = hnsw_links(g, node, layer);
+    if (links[0] < max) {
+        links[++links[0]] = other;
+        return;
+    }
+    Knn_item candidates[max + 1];
+    for (int j = 0; j < max; j++) {
+        candidates[j].img_idx = links[j + 1];
+        candidates[j].dist = metric_distance(g->fptr, data, links[j + 1], &data->images[node], NULL);
+    }
+    candidates[max].img_idx = other;
+    candidates[max].dist = metric_distance(g->fptr, data, other, &data->images[node], NULL);
+    qsort(candidates, max + 1, sizeof(Knn_item), knn_item_compare);
+    links[0] = hnsw_select(g, data, candidates, max + 1, max);
+    for (int j = 0; j < links[0]; j++) {
+        links[j + 1] = candidates[j].img_idx;
+    }
+}
+
+/* Add node, whose level is set, to the graph. found is scratch space for
+ * ef_construction items.
+ */
+static void hnsw_insert(struct Hnsw *g, Dataset *data, int node, Knn_item *found,
+                        int ef_construction) {
+    int level = g->levels[node];
+    if (g->entry == -1) {
+        g->entry = node;
+        g->max_level = level;
+        return;
+    }
+
+    // The nearest nodes found on each layer are where the next one starts
+    int entries[ef_construction];
+    int num_entries = 1;
+    entries[0] = g->entry;
+    for (int layer = g->max_level; layer >= 0; layer--) {
+        Knn_heap W = {found, 0, layer > level ? 1 : ef_construction};
+        hnsw_new_search(data->num_items);
+        hnsw_search_layer(g, data, &data->images[node], entries, num_entries, layer, &W);
+        if (W.size == 0) {
+            continue;
+        }
+        qsort(found, W.size, sizeof(Knn_item), knn_item_compare);
+        num_entries = W.size;
+        for (int i = 0; i < W.size; i++) {
+            entries[i] = found[i].img_idx;
+        }
+        if (layer <= level) {
+            int *links = hnsw_links(g, node, layer);
+            links[0] = hnsw_select(g, data, found, W.size, g->M);
+            for (int j = 0; j < links[0]; j++) {
+                links[j + 1] = found[j].img_idx;
+                hnsw_link(g, data, found[j].img_idx, layer, node);
+            }
+        }
+    }
+    if (level > g->max_level) {
+        g->max_level = level;
+        g->entry = node;
+    }
+}
+
+/* Offer the nearest images to input that a search of the graph finds to
+ * the heap, which gets the nearest heap->capacity of them.
+ */
+static void hnsw_search(struct Hnsw *g, Dataset *data, Image *input, Knn_heap *heap) {
+    if (g->entry == -1 || heap->capacity == 0) {
+        return;
+    }
+    int ef = g->ef > heap->capacity ? g->ef : heap->capacity;
+    Knn_item found[ef];
+    int entry = g->entry;
+    for (int layer = g->max_level; layer > 0; layer--) {
+        Knn_heap W = {found, 0, 1};
+        hnsw_new_search(data->num_items);
+        hnsw_search_layer(g, data, input, &entry, 1, layer, &W);
+        if (W.size > 0) {
+            entry = found[0].img_idx;
+        }
+    }
+    Knn_heap W = {found, 0, ef};
+    hnsw_new_search(data->num_items);
+    hnsw_search_layer(g, data, input, &entry, 1, 0, &W);
+    for (int i = 0; i < W.size; i++) {
+        knn_heap_offer(heap, found[i].dist, found[i].img_idx);
+    }
+}
+
+/**
+ * Build a hierarchical navigable small world graph over the images in data
+ * for the metric fptr, linking each node to up to M others (M >= 2), and
+ * attach it to data (replacing any earlier one). From then on, knn_predict
+ * with the same fptr searches the graph, keeping the max(ef, K) nearest
+ * images it finds, instead of every image: it is faster, but may not find
+ * all of the K nearest. The vantage-point tree, if any, is used first.
+ */
+void build_hnsw(Dataset *data, double (*fptr)(Image *, Image *), int M, int ef) {
+    free_hnsw(data);
+    int n = data->num_items > 0 ? data->num_items : 1;
+    struct Hnsw *g = malloc(sizeof(struct Hnsw));
+    if (g == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    g->fptr = fptr;
+    g->M = M;
+    g->ef = ef > 0 ? ef : 1;
+    g->num_items = data->num_items;
+    g->max_level = -1;
+    g->entry = -1;
+    g->levels = malloc(sizeof(int) * n);
+    g->upper = malloc(sizeof(int *) * n);
+    g->layer0 = calloc((size_t)n * (1 + 2 * M), sizeof(int));
+    int ef_construction = g->ef > HNSW_EF_CONSTRUCTION ? g->ef : HNSW_EF_CONSTRUCTION;
+    Knn_item *found = malloc(sizeof(Knn_item) * ef_construction);
+    if (g->levels == NULL || g->upper == NULL || g->layer0 == NULL || found == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    unsigned int seed = 209;
+    double scale = 1 / log(M);
+    for (int i = 0; i < data->num_items; i++) {
+        g->upper[i] = NULL;
+        if (fptr == distance_cosine && data->images[i].sqnorm == 0) {
+            g->levels[i] = -1;
+            continue;
+        }
+        g->levels[i] = (int)(-log((rand_r(&seed) + 1.0) / (RAND_MAX + 2.0)) * scale);
+        if (g->levels[i] > 0) {
+            g->upper[i] = calloc((size_t)g->levels[i] * (1 + M), sizeof(int));
+            if (g->upper[i] == NULL) {
+                perror("calloc");
+                exit(1);
+            }
+        }
+        hnsw_insert(g, data, i, found, ef_construction);
+    }
+    free(found);
+    data->hnsw = g;
+}
+
+/**
+ * Free the graph attached to data by build_hnsw, if any.
+ */
+void free_hnsw(Dataset *data) {
+    if (data->hnsw == NULL) {
+        return;
+    }
+    for (int i = 0; i < data->hnsw->num_items; i++) {
+        free(data->hnsw->upper[i]);
+    }
+    free(data->hnsw->upper);
+    free(data->hnsw->layer0);
+    free(data->hnsw->levels);
+    free(data->hnsw);
+    data->hnsw = NULL;
+}
+
+/* The scans knn_predict uses for the metrics it knows. Each offers every
+ * image of data to the heap at its distance from input, the same as the
+ * loop calling the metric through its pointer would, but with the kernel
+ * inlined and candidates that cannot get into the heap dropped early. It
+ * returns 0, having done nothing, if input or data are not in a form it
+ * handles.
+ */
+typedef int (*Scan)(Dataset *data, Image *input, Knn_heap *heap);
+
+static int scan_euclidean(Dataset *data, Image *input, Knn_heap *heap) {
+    if (input->sx * input->sy != NUM_PIXELS) {
+        return 0;
+    }
+    // distance_euclidean is the square root of an exact integer sum, so
+    // a candidate can only get into the heap if its squared distance is
+    // below the (exactly recoverable) square of the worst distance in
+    // it. Stop summing as soon as it reaches that.
+    long long compared = 0;
+    unsigned char padded[SLAB_STRIDE] __attribute__((aligned(SLAB_ALIGN)));
+    if (data->slab != NULL) {
+        memcpy(padded, input->data, NUM_PIXELS);
+        memset(padded + NUM_PIXELS, 0, SLAB_STRIDE - NUM_PIXELS);
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        unsigned int bound = UINT_MAX;
+        if (heap->size == heap->capacity) {
+            bound = heap->capacity > 0 ?
+                (unsigned int)llround(heap->items[0].dist * heap->items[0].dist) : 0;
+        }
+        unsigned int sq;
+        if (data->slab != NULL) {
+            sq = distance_sq_bounded_rows(dataset_pixels(data, i), padded, bound,
+                                          data->block_order, &compared);
+        } else {
+            sq = distance_sq_bounded(dataset_pixels(data, i), input->data, bound,
+                                     data->block_order, &compared);
+        }
+        if (sq < bound) {
+            knn_heap_offer(heap, sqrt(sq), i);
+        }
+    }
+    __atomic_fetch_add(&pixels_compared, compared, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pixels_skipped, (long long)data->num_items * NUM_PIXELS - compared,
+                       __ATOMIC_RELAXED);
+    return 1;
+}
+
+static int scan_cosine(Dataset *data, Image *input, Knn_heap *heap) {
+    if (input->sx * input->sy != NUM_PIXELS) {
+        return 0;
+    }
+    // Rank by the cosine similarity, which needs just a dot product
+    // since the norms are cached, and only take the acos of candidates
+    // that can get into the heap: one less similar than the worst image
+    // in it is at least as far away and comes later, so would be
+    // rejected anyway. All zero images are at a NAN distance, never kept.
+    int worst_idx = -1;
+    double worst_sim = 0;
+    for (int i = 0; i < data->num_items && heap->capacity > 0; i++) {
+        Image *candidate = &data->images[i];
+        if (candidate->sqnorm == 0 || input->sqnorm == 0) {
+            continue;
+        }
+        double sim = cosine_similarity(dot_pixels(dataset_pixels(data, i), input->data),
+                                       candidate->sqnorm, input->sqnorm);
+        if (heap->size == heap->capacity) {
+            if (heap->items[0].img_idx != worst_idx) {
+                worst_idx = heap->items[0].img_idx;
+                worst_sim = cosine_similarity(dot_pixels(dataset_pixels(data, worst_idx),
+                                                         input->data),
+                                              data->images[worst_idx].sqnorm, input->sqnorm);
+            }
+            if (sim < worst_sim) {
+                continue;
+            }
+        }
+        knn_heap_offer(heap, cosine_to_distance(sim), i);
+    }
+    return 1;
+}
+
+static int scan_hamming(Dataset *data, Image *input, Knn_heap *heap) {
+    if (data->bits == NULL || input->bits == NULL) {
+        return 0;
+    }
+    // The distance is a small integer, so a candidate no nearer than
+    // the worst image in the full heap can be dropped without a call
+    for (int i = 0; i < data->num_items && heap->capacity > 0; i++) {
+        unsigned int d = hamming_words(data->images[i].bits, input->bits);
+        if (heap->size < heap->capacity || d < heap->items[0].dist) {
+            knn_heap_offer(heap, d, i);
+        }
+    }
+    return 1;
+}
+
+/* Define scan_<name> for a metric whose distance between n pixels of two
+ * images is KERNEL(a, b, n), a small integer. With a slab the rows are
+ * compared whole (the padding is zero in both, so adds nothing), which
+ * gives the inlined kernel a fixed length and aligned rows to vectorise,
+ * with an AVX2 version picked at load time if the CPU has it. As with
+ * hamming, a candidate no nearer than the worst in the full heap is
+ * dropped without an offer.
+ */
+#define DEFINE_PIXEL_SCAN(name, KERNEL)                                                      \
+    __attribute__((optimize("tree-vectorize"), target_clones("avx2", "default")))            \
+    static int scan_##name(Dataset *data, Image *input, Knn_heap *heap) {                    \
+        if (input->sx * input->sy != NUM_PIXELS) {                                           \
+            return 0;                                                                        \
+        }                                                                                    \
+        unsigned char padded[SLAB_STRIDE] __attribute__((aligned(SLAB_ALIGN)));             \
+        memcpy(padded, input->data, NUM_PIXELS);                                             \
+        memset(padded + NUM_PIXELS, 0, SLAB_STRIDE - NUM_PIXELS);                            \
+        for (int i = 0; i < data->num_items && heap->capacity > 0; i++) {                    \
+            unsigned int d;                                                                  \
+            if (data->slab != NULL) {                                                        \
+                d = KERNEL(__builtin_assume_aligned(dataset_pixels(data, i), SLAB_ALIGN),    \
+                           padded, SLAB_STRIDE);                                             \
+            } else {                                                                         \
+                d = KERNEL(data->images[i].data, padded, NUM_PIXELS);                        \
+            }                                                                                \
+            if (heap->size < heap->capacity || d < heap->items[0].dist) {                    \
+                knn_heap_offer(heap, d, i);                                                  \
+            }                                                                                \
+        }                                                                                    \
+        return 1;                                                                            \
+    }
+
+DEFINE_PIXEL_SCAN(manhattan, manhattan_pixels)
+DEFINE_PIXEL_SCAN(chebyshev, chebyshev_pixels)
+
+/* Return the scan for the metric fptr, or NULL if it has none. */
+static Scan metric_scan(double (*fptr)(Image *, Image *)) {
+    static const struct {
+        double (*fptr)(Image *, Image *);
+        Scan scan;
+    } scans[] = {
+        {distance_euclidean, scan_euclidean},
+        {distance_cosine, scan_cosine},
+        {distance_manhattan, scan_manhattan},
+        {distance_chebyshev, scan_chebyshev},
+        {distance_hamming, scan_hamming},
+    };
+    for (size_t i = 0; i < sizeof(scans) / sizeof(scans[0]); i++) {
+        if (scans[i].fptr == fptr) {
+            return scans[i].scan;
+        }
+    }
+    return NULL;
+}
+
+static int knn_search(Dataset *data, Image *input, double (*fptr)(Image *, Image *),
+                      Knn_heap *heap);
+
+/* Return the most frequent label of the images of data in heap (the
+ * smallest of those tied).
+ */
+static int knn_vote(Dataset *data, Knn_heap *heap) {
+    // Count the frequencies of the labels
+    int counts[10] = {0};
+    for (int i = 0; i < heap->size; i++) {
+        counts[data->labels[heap->items[i].img_idx]]++;
+    }
+    
+    // Find the most frequent label
+    int max_count = 0, max_label = 1;
+    for (int i = 0; i < 10; i++) {
+        if (counts[i] > max_count) {
+            max_count = counts[i];
+            max_label = i;
+        }
+    }
+
+    return max_label;
+}
+
+/**
+ * Given the input training dataset, an image to classify and K as well as a 
+ * distance function specified by fptr,
+ *   (1) Find the K most similar images to `input` in the dataset
+ *   (2) Return the most frequent label of these K images.  If two are tied, 
+ *       output the smaller label.
+ */ 
+int knn_predict(Dataset *data, Image *input, int K, double (*fptr)(Image *, Image *)) {
+    return knn_predict_distance(data, input, K, fptr, NULL);
+}
+
+/**
+ * Return the same prediction as knn_predict, and if kth_dist is not NULL
+ * store in it the distance to the farthest of the K nearest images (NAN if
+ * there are none). With projected images it is the distance between the
+ * projections.
+ */
+int knn_predict_distance(Dataset *data, Image *input, int K, double (*fptr)(Image *, Image *),
+                         double *kth_dist) {
+
+    // Heap of the K-closest images so far.
+    Knn_item smallest[K];
+    Knn_heap heap = {smallest, 0, K};
+    int squared = knn_search(data, input, fptr, &heap);
+
+    if (kth_dist != NULL) {
+        *kth_dist = heap.size == 0 ? NAN : squared ? sqrt(smallest[0].dist) : smallest[0].dist;
+    }
+    return knn_vote(data, &heap);
+}
+
+/* Offer every image of data to heap in index order, with the scan for fptr
+ * if there is one.
+ */
+static void knn_scan(Dataset *data, Image *input, double (*fptr)(Image *, Image *),
+                     Knn_heap *heap) {
+    Scan scan = metric_scan(fptr);
+    if (scan == NULL || !scan(data, input, heap)) {
+        // For each training image, compute the distance using the function pointer
+        for (int i = 0; i < data->num_items; i++) {
+            knn_heap_offer(heap, fptr(&data->images[i], input), i);
+        }
+    }
+}
+
+/* Put the nearest images of data to input into the empty heap by searching
+ * the vantage-point tree of data, and return 1. If the search finds images
+ * left out of the heap that are as near as the worst one in it, which of
+ * the tied images the heap keeps depends on the order they were seen in,
+ * so empty the heap again and return 0 for the caller to scan instead.
+ */
+static int vptree_knn(Dataset *data, Image *input, Knn_heap *heap) {
+    long long computed = 0;
+    int tied = 0;
+    if (heap->capacity > 0) {
+        vptree_search(data->vptree, 0, data, input, heap, &tied, &computed);
+    }
+    if (tied > 0) {
+        heap->size = 0;
+        heap->logged = 0;
+        computed += data->num_items;
+    }
+    __atomic_fetch_add(&vptree_computed, computed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&vptree_searched, data->num_items, __ATOMIC_RELAXED);
+    return tied == 0;
+}
+
+/* Offer every image of data that could be among the nearest to input by
+ * fptr to heap, with the fastest search there is for it. Return 1 if the
+ * distances in the heap are squared (for projected images), 0 if not.
+ */
+static int knn_search(Dataset *data, Image *input, double (*fptr)(Image *, Image *),
+                      Knn_heap *heap) {
+    int K = heap->capacity;
+    Knn_item *smallest = heap->items;
+    int squared = 0;
+
+    // The images of data have their norms from the loader, but input may
+    // have been made by the caller, so work its norm out here
+    Image query = *input;
+    if (input->sx * input->sy == NUM_PIXELS) {
+        query.sqnorm = dot_pixels(input->data, input->data);
+    }
+    input = &query;
+
+    if (fptr == distance_euclidean && data->proj != NULL && input->proj != NULL) {
+        // Rank by the squared distance between the projections instead:
+        // the ranking is the same as by the distance, and only the
+        // indexes of the nearest images are needed
+        squared = 1;
+        for (int i = 0; i < data->num_items && K > 0; i++) {
+            float sq = distance_sq_floats(data->images[i].proj, input->proj, data->proj_stride);
+            if (heap->size < heap->capacity || sq <= smallest[0].dist) {
+                knn_heap_offer(heap, sq, i);
+            }
+        }
+    } else if (data->vptree != NULL && data->vptree->fptr == fptr) {
+        if (!vptree_knn(data, input, heap)) {
+            knn_scan(data, input, fptr, heap);
+        }
+    } else if (data->hnsw != NULL && data->hnsw->fptr == fptr) {
+        hnsw_search(data->hnsw, data, input, heap);
+    } else {
+        knn_scan(data, input, fptr, heap);
+    }
+    return squared;
+}
+
+
+/** 
+ * Free all the allocated memory for the dataset
+ * Check to ensure that the function works properly when `data' is allocated
+ * as well as when `data' is not allocated.
+ */
+void free_dataset(Dataset *data) {
+    if (data == NULL) {
+        return;
+    }
+
+    if (data->map != NULL && munmap(data->map, data->map_size) == -1) {
+        perror("munmap");
+    }
+    free_vptree(data);
+    free_hnsw(data);
+    free(data->slab);
+    free(data->bits);
+    free(data->proj);
+    free(data->images);
+    free(data->labels);
+    free(data);
+}
+
+
+
+/************************** A3 Code below ************************************/
+
+/* The test images of a run, handed out to the children in chunks. It is in
+ * memory shared by them (see new_work_queue), so taking a chunk is just an
+ * atomic update of next, and each child records how it did in its stats.
+ */
+typedef struct {
+    int images;       // Test images classified
+    int chunks;       // Chunks taken
+    double busy;      // Seconds spent classifying
+    double finish;    // Seconds from the start of the run to the last image
+    double p50, p99, max;  // Seconds taken to classify an image
+    int node;         // NUMA node it was placed on (see place_worker), or -1
+} WorkerStats;
+
+struct WorkQueue {
+    int next;         // First test image not yet handed out
+    int num_items;
+    int num_workers;
+    int dynamic;      // If 0, worker i takes just the i-th of num_workers slices
+    double start;     // CLOCK_MONOTONIC time the run started
+    WorkerStats stats[];
+};
+
+/* Smallest chunk a child takes when scheduling dynamically, so the shared
+ * counter is not updated for every image at the end of a run.
+ */
+#define MIN_CHUNK 4
+
+static double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Return a queue of the num_items test images of a run for num_workers
+ * children, mapped shared so that it must be made before they are forked.
+ * If dynamic, children take chunks of the images left as they go (see
+ * next_chunk); otherwise each takes a fixed slice of them, as the
+ * original static split did.
+ */
+struct WorkQueue *new_work_queue(int num_items, int num_workers, int dynamic) {
+    size_t size = sizeof(struct WorkQueue) + sizeof(WorkerStats) * num_workers;
+    struct WorkQueue *queue = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (queue == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(queue, 0, size);
+    queue->num_items = num_items;
+    queue->num_workers = num_workers;
+    queue->dynamic = dynamic;
+    queue->start = monotonic_seconds();
+    for (int w = 0; w < num_workers; w++) {
+        queue->stats[w].node = -1;
+    }
+    return queue;
+}
+
+/**
+ * Unmap a queue made by new_work_queue.
+ */
+void free_work_queue(struct WorkQueue *queue) {
+    if (queue != NULL &&
+        munmap(queue, sizeof(struct WorkQueue) + sizeof(WorkerStats) * queue->num_workers) == -1) {
+        perror("munmap");
+    }
+}
+
+/* Take the next chunk of test images for worker: store the index of the
+ * first one in *first and return how many there are, 0 once there are
+ * none left. Dynamic chunks are guided: a share of what is left, so they
+ * are large while there is plenty (few updates of the counter) and shrink
+ * to MIN_CHUNK at the end, where a worker that got a slow chunk would
+ * otherwise hold up the rest.
+ */
+static int next_chunk(struct WorkQueue *queue, int worker, int *first) {
+    if (!queue->dynamic) {
+        if (queue->stats[worker].chunks > 0) {
+            return 0;
+        }
+        *first = (long long)queue->num_items * worker / queue->num_workers;
+        return (long long)queue->num_items * (worker + 1) / queue->num_workers - *first;
+    }
+    int start = __atomic_load_n(&queue->next, __ATOMIC_RELAXED);
+    for (;;) {
+        int remaining = queue->num_items - start;
+        if (remaining <= 0) {
+            return 0;
+        }
+        int size = remaining / (2 * queue->num_workers);
+        size = size < MIN_CHUNK ? MIN_CHUNK : size;
+        size = size < remaining ? size : remaining;
+        if (__atomic_compare_exchange_n(&queue->next, &start, start + size, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            *first = start;
+            return size;
+        }
+    }
+}
+
+/* Where the workers of a run go: the CPUs this process may run on, grouped
+ * by NUMA node (as listed in sysfs; all on one node if it is not there),
+ * and optionally a copy of the training set on each node.
+ */
+#define MAX_NODES 64
+
+struct Placement {
+    int num_nodes;
+    int node_ids[MAX_NODES];         // Node number of each group
+    int first_cpu[MAX_NODES + 1];    // The CPUs of group n are cpus[first_cpu[n]...]
+    int cpus[CPU_SETSIZE];
+    Dataset *replicas[MAX_NODES];    // Copy of the training set on each node, or NULL
+};
+
+/* Add the CPUs in the sysfs cpulist (such as "0-3,8,10-11") that are also
+ * in allowed to set.
+ */
+static void parse_cpulist(const char *list, cpu_set_t *allowed, cpu_set_t *set) {
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p) {
+            break;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+            if (c >= 0 && CPU_ISSET(c, allowed)) {
+                CPU_SET(c, set);
+            }
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* Copy the pixels of data, and what the searches use with them, into a new
+ * Dataset laid out as a slab. Everything else (labels, binarized and
+ * projected images, indexes) is shared with data, so it must only be
+ * freed by free_replica.
+ */
+static Dataset *replicate_dataset(Dataset *data) {
+    Dataset *copy = malloc(sizeof(Dataset));
+    if (copy == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    *copy = *data;
+    copy->map = NULL;
+    copy->map_size = 0;
+    size_t slab_size = (size_t)data->num_items * SLAB_STRIDE;
+    copy->images = malloc(sizeof(Image) * (data->num_items > 0 ? data->num_items : 1));
+    if (copy->images == NULL ||
+        posix_memalign((void **)&copy->slab, SLAB_ALIGN, slab_size > 0 ? slab_size : SLAB_ALIGN) != 0) {
+        fprintf(stderr, "Could not allocate a copy of the training set\n");
+        exit(1);
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        unsigned char *row = copy->slab + (size_t)i * SLAB_STRIDE;
+        memcpy(row, dataset_pixels(data, i), NUM_PIXELS);
+        memset(row + NUM_PIXELS, 0, SLAB_STRIDE - NUM_PIXELS);
+        copy->images[i] = data->images[i];
+        copy->images[i].data = row;
+    }
+    return copy;
+}
+
+static void free_replica(Dataset *copy) {
+    if (copy != NULL) {
+        free(copy->slab);
+        free(copy->images);
+        free(copy);
+    }
+}
+
+typedef struct {
+    Dataset *training;
+    Dataset *copy;
+} ReplicaJob;
+
+static void *replica_worker(void *arg) {
+    ReplicaJob *job = arg;
+    job->copy = replicate_dataset(job->training);
+    return NULL;
+}
+
+/**
+ * Find the CPUs this process may run on and their NUMA nodes, for
+ * place_worker. If replicate, also copy training once per node, each copy
+ * made by a thread running on that node so that its pages are allocated
+ * there (the kernel's first touch policy); workers then read the training
+ * pixels from local memory instead of the node the parent loaded them on.
+ * The copies must be made before the workers are forked, which then share
+ * them. They are slabs, so they cost num_items * SLAB_STRIDE bytes a node.
+ */
+struct Placement *new_placement(Dataset *training, int replicate) {
+    struct Placement *p = calloc(1, sizeof(struct Placement));
+    if (p == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        exit(1);
+    }
+
+    int num_cpus = 0;
+    for (int node = 0; node < 4096 && p->num_nodes < MAX_NODES; node++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), f) == NULL) {
+            list[0] = '\0';
+        }
+        fclose(f);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        parse_cpulist(list, &allowed, &set);
+        if (CPU_COUNT(&set) == 0) {
+            continue;
+        }
+        p->node_ids[p->num_nodes] = node;
+        p->first_cpu[p->num_nodes] = num_cpus;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) {
+                p->cpus[num_cpus++] = c;
+            }
+        }
+        p->num_nodes++;
+    }
+    if (p->num_nodes == 0) {
+        // No NUMA information: one node with every allowed CPU
+        p->num_nodes = 1;
+        p->node_ids[0] = 0;
+        p->first_cpu[0] = 0;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &allowed)) {
+                p->cpus[num_cpus++] = c;
+            }
+        }
+    }
+    p->first_cpu[p->num_nodes] = num_cpus;
+
+    for (int n = 0; replicate && n < p->num_nodes; n++) {
+        ReplicaJob job = {training, NULL};
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int i = p->first_cpu[n]; i < p->first_cpu[n + 1]; i++) {
+            CPU_SET(p->cpus[i], &set);
+        }
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, replica_worker, &job) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+        pthread_join(thread, NULL);
+        pthread_attr_destroy(&attr);
+        p->replicas[n] = job.copy;
+    }
+    return p;
+}
+
+/**
+ * Pin the calling process (or thread) to the CPU for worker, record its
+ * node in queue (which may be NULL), and return the training set it should
+ * read: the copy on its node if there is one, or else training. Workers
+ * are spread over the nodes in turn (worker w on node w % nodes), then
+ * over the CPUs of each node, so that they split evenly between them.
+ */
+Dataset *place_worker(struct Placement *p, Dataset *training, int worker,
+                      struct WorkQueue *queue) {
+    int n = worker % p->num_nodes;
+    int count = p->first_cpu[n + 1] - p->first_cpu[n];
+    if (count > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(p->cpus[p->first_cpu[n] + (worker / p->num_nodes) % count], &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+            perror("sched_setaffinity");
+        }
+    }
+    if (queue != NULL) {
+        queue->stats[worker].node = p->node_ids[n];
+    }
+    return p->replicas[n] != NULL ? p->replicas[n] : training;
+}
+
+/**
+ * Free a placement made by new_placement, and its copies of the training
+ * set.
+ */
+void free_placement(struct Placement *p) {
+    if (p == NULL) {
+        return;
+    }
+    for (int n = 0; n < p->num_nodes; n++) {
+        free_replica(p->replicas[n]);
+    }
+    free(p);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* The predictions of a run, in memory shared by the workers and the parent
+ * (see new_result_area). Test image i has a slot of its own, written only
+ * by the worker that took it, so the slots need no locking; the workers
+ * publish what they have written by adding to correct and then done, which
+ * the parent sleeps on as a futex (see wait_for_results).
+ */
+struct ResultArea {
+    int done;         // Test images predicted so far (the futex word)
+    int correct;      // Of them, those predicted correctly
+    int num_items;
+    size_t size;      // Length of the mapping in bytes
+    PredictionRecord records[];
+};
+
+static long futex(int *word, int op, int value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/**
+ * Return the result area for a run of num_items test images: a shm_open
+ * object mapped shared, so that it must be made before the children are
+ * forked. Its name is unlinked at once, so it goes away with the last
+ * mapping and is never left behind. Every slot starts with img_idx -1
+ * (not predicted).
+ */
+struct ResultArea *new_result_area(int num_items) {
+    static int made = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/a3-results-%d-%d", (int)getpid(), made++);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        perror("shm_open");
+        exit(1);
+    }
+    if (shm_unlink(name) == -1) {
+        perror("shm_unlink");
+        exit(1);
+    }
+    size_t size = sizeof(struct ResultArea) + sizeof(PredictionRecord) * num_items;
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+    struct ResultArea *area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (area == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    area->num_items = num_items;
+    area->size = size;
+    for (int i = 0; i < num_items; i++) {
+        area->records[i].img_idx = -1;
+    }
+    return area;
+}
+
+/**
+ * Return the slots of area: the record for test image i is element i.
+ */
+PredictionRecord *result_records(struct ResultArea *area) {
+    return area->records;
+}
+
+/**
+ * Unmap a result area made by new_result_area.
+ */
+void free_result_area(struct ResultArea *area) {
+    if (area != NULL && munmap(area, area->size) == -1) {
+        perror("munmap");
+    }
+}
+
+/* Make count more predictions of area visible to the parent, correct of
+ * them right, and wake it if it is waiting.
+ */
+static void publish_results(struct ResultArea *area, int count, int correct) {
+    __atomic_fetch_add(&area->correct, correct, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&area->done, count, __ATOMIC_RELEASE);
+    futex(&area->done, FUTEX_WAKE, 1, NULL);
+}
+
+/**
+ * Wait until the workers have predicted every test image of area, and
+ * return the number predicted correctly. If num_children is not 0 the
+ * workers are that many child processes, which are reaped here; should
+ * they all exit first, the images left are not waited for (their slots
+ * keep img_idx -1). With verbose, the number predicted and the accuracy
+ * so far are shown on stderr as they are published.
+ */
+int wait_for_results(struct ResultArea *area, int num_children, int verbose) {
+    int reaped = 0;
+    double shown = 0;
+    for (;;) {
+        int done = __atomic_load_n(&area->done, __ATOMIC_ACQUIRE);
+        if (verbose && monotonic_seconds() - shown >= 0.1) {
+            int correct = __atomic_load_n(&area->correct, __ATOMIC_RELAXED);
+            fprintf(stderr, "\r- %d of %d classified, %.1f%% correct so far", done,
+                    area->num_items, done > 0 ? 100.0 * correct / done : 0.0);
+            shown = monotonic_seconds();
+        }
+        pid_t pid;
+        int status;
+        while (reaped < num_children && (pid = waitpid(-1, &status, WNOHANG)) != 0) {
+            if (pid == -1) {
+                perror("waitpid");
+                exit(1);
+            }
+            reaped++;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "A child failed: its test images are left unpredicted\n");
+            }
+        }
+        if (done == area->num_items || (num_children > 0 && reaped == num_children)) {
+            break;
+        }
+        // Sleep until a worker publishes, looking at the children now and then
+        struct timespec timeout = {0, 100000000};
+        if (futex(&area->done, FUTEX_WAIT, done, &timeout) == -1 && errno != EAGAIN &&
+            errno != ETIMEDOUT && errno != EINTR) {
+            perror("futex");
+            exit(1);
+        }
+    }
+    for (; reaped < num_children; reaped++) {
+        if (wait(NULL) == -1) {
+            perror("wait");
+            exit(1);
+        }
+    }
+
+    int done = __atomic_load_n(&area->done, __ATOMIC_ACQUIRE);
+    int correct = __atomic_load_n(&area->correct, __ATOMIC_RELAXED);
+    if (verbose) {
+        fprintf(stderr, "\r- %d of %d classified, %.1f%% correct\n", done, area->num_items,
+                done > 0 ? 100.0 * correct / done : 0.0);
+    }
+    return correct;
+}
+
+/* Classify the chunks worker takes from queue until there are none left,
+ * recording its stats in the queue. The record for test image i goes in
+ * its slot of results, and they are published every RESULT_BATCH images
+ * and at the end of each chunk.
+ */
+static void classify_from_queue(Dataset *training, Dataset *testing, int K,
+                                double (*fptr)(Image *, Image *), struct WorkQueue *queue,
+                                int worker, struct ResultArea *results) {
+    WorkerStats *stats = &queue->stats[worker];
+    double *latency = malloc(sizeof(double) * (testing->num_items > 0 ? testing->num_items : 1));
+    if (latency == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int first, count;
+    double end = queue->start;
+    while ((count = next_chunk(queue, worker, &first)) > 0) {
+        stats->chunks++;
+        int pending = 0, pending_correct = 0;
+        for (int i = first; i < first + count; i++) {
+            double start = monotonic_seconds();
+            double kth_dist;
+            PredictionRecord *record = &results->records[i];
+            record->label = knn_predict_distance(training, &testing->images[i], K, fptr,
+                                                 &kth_dist);
+            record->kth_dist = kth_dist;
+            record->img_idx = i;
+            pending_correct += record->label == testing->labels[i];
+            end = monotonic_seconds();
+            latency[stats->images++] = end - start;
+            stats->busy += end - start;
+            if (++pending == RESULT_BATCH) {
+                publish_results(results, pending, pending_correct);
+                pending = pending_correct = 0;
+            }
+        }
+        if (pending > 0) {
+            publish_results(results, pending, pending_correct);
+        }
+    }
+    stats->finish = end - queue->start;
+    if (stats->images > 0) {
+        qsort(latency, stats->images, sizeof(double), compare_doubles);
+        stats->p50 = latency[(stats->images - 1) / 2];
+        stats->p99 = latency[(int)((stats->images - 1) * 0.99)];
+        stats->max = latency[stats->images - 1];
+    }
+    free(latency);
+}
+
+/**
+ * child_handler_queue is called by each child process unless it serves
+ * batches (see worker_handler): it classifies the chunks that worker takes
+ * from queue until there are none left and records its stats in the
+ * queue. The predictions go straight
+ * into their slots of results, which the parent reads as they are
+ * published (see wait_for_results), so no pipes are needed.
+ */
+void child_handler_queue(Dataset *training, Dataset *testing, int K,
+                         double (*fptr)(Image *, Image *), struct WorkQueue *queue, int worker,
+                         struct ResultArea *results) {
+    classify_from_queue(training, testing, K, fptr, queue, worker, results);
+}
+
+/* What each thread of classify_threads works on. */
+typedef struct {
+    Dataset *training;
+    Dataset *testing;
+    int K;
+    double (*fptr)(Image *, Image *);
+    struct WorkQueue *queue;
+    int worker;
+    struct ResultArea *results;
+    struct Placement *placement;
+} ThreadWorker;
+
+static void *thread_worker(void *arg) {
+    ThreadWorker *w = arg;
+    Dataset *training = w->training;
+    if (w->placement != NULL) {
+        training = place_worker(w->placement, training, w->worker, w->queue);
+    }
+    classify_from_queue(training, w->testing, w->K, w->fptr, w->queue, w->worker, w->results);
+    return NULL;
+}
+
+/**
+ * Classify every image of testing with one thread per worker of queue,
+ * instead of child processes: the threads share training and testing as
+ * they are, with no copy-on-write, and store their predictions in results
+ * as the children do, while this thread waits for them (see
+ * wait_for_results). Return the number predicted correctly. If placement
+ * is not NULL, each thread is placed by place_worker.
+ */
+int classify_threads(Dataset *training, Dataset *testing, int K,
+                     double (*fptr)(Image *, Image *), struct WorkQueue *queue,
+                     struct ResultArea *results, struct Placement *placement, int verbose) {
+    int num_workers = queue->num_workers;
+    pthread_t threads[num_workers > 0 ? num_workers : 1];
+    ThreadWorker workers[num_workers > 0 ? num_workers : 1];
+
+    for (int t = 0; t < num_workers; t++) {
+        workers[t] = (ThreadWorker){training, testing, K, fptr, queue, t, results, placement};
+        if (pthread_create(&threads[t], NULL, thread_worker, &workers[t]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    int correct = wait_for_results(results, 0, verbose);
+    for (int t = 0; t < num_workers; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    return correct;
+}
+
+/**
+ * Write the predictions in records (see result_records) to filename,
+ * one line per test image: its index, its label, the predicted label and
+ * the distance to the K-th nearest training image.
+ */
+void write_predictions(const char *filename, Dataset *testing, PredictionRecord *records) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    fprintf(f, "index,label,predicted,kth_distance\n");
+    for (int i = 0; i < testing->num_items; i++) {
+        if (records[i].img_idx == -1) {
+            fprintf(f, "%d,%d,,\n", i, testing->labels[i]);
+        } else {
+            fprintf(f, "%d,%d,%d,%.6g\n", i, testing->labels[i], records[i].label,
+                    records[i].kth_dist);
+        }
+    }
+    if (fclose(f) == EOF) {
+        perror(filename);
+        exit(1);
+    }
+}
+
+/**
+ * Print, to stderr, the confusion matrix of the predictions in records (a
+ * row per label, a column per predicted label) and the accuracy for each
+ * label.
+ */
+void print_confusion_matrix(Dataset *testing, PredictionRecord *records) {
+    int matrix[10][10] = {{0}};
+    for (int i = 0; i < testing->num_items; i++) {
+        if (records[i].img_idx != -1) {
+            matrix[testing->labels[i]][records[i].label]++;
+        }
+    }
+    fprintf(stderr, "- label \\ predicted");
+    for (int p = 0; p < 10; p++) {
+        fprintf(stderr, " %5d", p);
+    }
+    fprintf(stderr, "  accuracy\n");
+    for (int l = 0; l < 10; l++) {
+        int total = 0;
+        fprintf(stderr, "- %17d", l);
+        for (int p = 0; p < 10; p++) {
+            fprintf(stderr, " %5d", matrix[l][p]);
+            total += matrix[l][p];
+        }
+        if (total > 0) {
+            fprintf(stderr, "  %7.1f%%\n", 100.0 * matrix[l][l] / total);
+        } else {
+            fprintf(stderr, "  %8s\n", "-");
+        }
+    }
+}
+
+/**
+ * Print, to stderr, how each child of a run (after they have all exited)
+ * did: the test images and chunks it took, the time it was busy, when it
+ * finished and its median, 99th percentile and slowest time per image.
+ * The gap between the first and last to finish is time lost to an uneven
+ * split of the work.
+ */
+void print_work_stats(struct WorkQueue *queue) {
+    fprintf(stderr, "- %6s %5s %7s %7s %9s %10s %9s %9s %9s\n", "worker", "node", "images",
+            "chunks", "busy (s)", "finish (s)", "p50 (ms)", "p99 (ms)", "max (ms)");
+    double first = INFINITY, last = 0;
+    int placed = 0;
+    for (int w = 0; w < queue->num_workers; w++) {
+        WorkerStats *stats = &queue->stats[w];
+        fprintf(stderr, "- %6d %5d %7d %7d %9.3f %10.3f %9.3f %9.3f %9.3f\n", w, stats->node,
+                stats->images, stats->chunks, stats->busy, stats->finish, stats->p50 * 1e3,
+                stats->p99 * 1e3, stats->max * 1e3);
+        first = stats->finish < first ? stats->finish : first;
+        last = stats->finish > last ? stats->finish : last;
+        placed |= stats->node != -1;
+    }
+    fprintf(stderr, "- Last worker finished %.3fs after the first\n",
+            queue->num_workers > 0 ? last - first : 0);
+
+    // Per node: a node whose workers classify fewer images per busy second
+    // than the others is probably reading remote memory
+    for (int node = 0; placed && node < 4096; node++) {
+        int workers = 0, images = 0;
+        double busy = 0;
+        for (int w = 0; w < queue->num_workers; w++) {
+            if (queue->stats[w].node == node) {
+                workers++;
+                images += queue->stats[w].images;
+                busy += queue->stats[w].busy;
+            }
+        }
+        if (workers > 0) {
+            fprintf(stderr, "- Node %d: %d workers, %d images, %.1f images/s per worker\n",
+                    node, workers, images, busy > 0 ? images / busy : 0);
+        }
+    }
+}
+
+/**
+ * This function computes the cosine distance.  It should be called similarly to
+ * the function distance() above except the formula that it should evaluate is
+ * distance = 2*arccos( sum(a[i]*b[i]) / (sqrt(sum(a[i]^2) sqrt(sum(b[i]^2)))/pi
+ * See (https://en.wikipedia.org/wiki/Cosine_similarity) for more information.
+ *   - use the constant M_PI for pi.  M_PI is defined in math.h
+ *   - "man acos" describes the arc cos funciton in the C math library
+ *
+ * The sums of squares are computed here too, as a or b may not have come
+ * from the loader; the scans use the cached ones instead (see scan_cosine).
+*/
+double distance_cosine(Image *a, Image *b) {
+    if (a->sx * a->sy == NUM_PIXELS) {
+        return cosine_to_distance(cosine_similarity(dot_pixels(a->data, b->data),
+                                                    dot_pixels(a->data, a->data),
+                                                    dot_pixels(b->data, b->data)));
+    }
+    double dot = 0, sqnorm_a = 0, sqnorm_b = 0;
+    for (int i = 0; i < a->sx * a->sy; i++) {
+        dot += a->data[i] * b->data[i];
+        sqnorm_a += a->data[i] * a->data[i];
+        sqnorm_b += b->data[i] * b->data[i];
+    }
+    return cosine_to_distance(cosine_similarity(dot, sqnorm_a, sqnorm_b));
+}
+
+/* Set the BIT_WORDS words of row to the binarized pixels.
+ */
+static void binarize_pixels(const unsigned char *pixels, unsigned long long *row) {
+    memset(row, 0, BIT_WORDS * sizeof(unsigned long long));
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        if (pixels[p] >= BIT_THRESHOLD) {
+            row[p / 64] |= 1ULL << (p % 64);
+        }
+    }
+}
+
+/**
+ * Binarize every image in data: pack its pixels into BIT_WORDS words, one
+ * bit per pixel, set if the pixel is at least BIT_THRESHOLD. The rows are
+ * kept together in data->bits, and each image's bits point at its row.
+ * The binarized set is about an eighth of the size of the pixels.
+ */
+void binarize_dataset(Dataset *data) {
+    if (data->bits != NULL) {
+        return;
+    }
+    size_t size = (size_t)data->num_items * BIT_WORDS * sizeof(unsigned long long);
+    if (posix_memalign((void **)&data->bits, SLAB_ALIGN, size > 0 ? size : SLAB_ALIGN) != 0) {
+        fprintf(stderr, "Could not allocate the binarized images\n");
+        exit(1);
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        unsigned long long *row = data->bits + (size_t)i * BIT_WORDS;
+        binarize_pixels(dataset_pixels(data, i), row);
+        data->images[i].bits = row;
+    }
+}
+
+/**
+ * Return the hamming distance between the binarized images a and b: the
+ * number of pixels that are on one side of BIT_THRESHOLD in one image and
+ * on the other side in the other. Images that have not been binarized
+ * (see binarize_dataset) are compared pixel by pixel.
+ */
+double distance_hamming(Image *a, Image *b) {
+    if (a->bits != NULL && b->bits != NULL) {
+        return hamming_words(a->bits, b->bits);
+    }
+    int d = 0;
+    for (int i = 0; i < a->sx * a->sy; i++) {
+        d += (a->data[i] >= BIT_THRESHOLD) != (b->data[i] >= BIT_THRESHOLD);
+    }
+    return d;
+}
+
+/**
+ * Return the manhattan distance between the image pixels (as vectors):
+ * d = sum(|a[i]-b[i]|).
+ */
+double distance_manhattan(Image *a, Image *b) {
+    return manhattan_pixels(a->data, b->data, a->sx * a->sy);
+}
+
+/**
+ * Return the chebyshev distance between the image pixels (as vectors):
+ * d = max(|a[i]-b[i]|).
+ */
+double distance_chebyshev(Image *a, Image *b) {
+    return chebyshev_pixels(a->data, b->data, a->sx * a->sy);
+}
+
+/**
+ * The metrics knn_predict has scans of its own for, in the order
+ * find_metric tries them.
+ */
+const Metric metrics[NUM_METRICS] = {
+    {"euclidean", distance_euclidean, 0},
+    {"cosine", distance_cosine, 0},
+    {"manhattan", distance_manhattan, 0},
+    {"chebyshev", distance_chebyshev, 0},
+    {"hamming", distance_hamming, 1},
+};
+
+/**
+ * Return the first of metrics whose name starts with name (so "eucl" is
+ * euclidean, and "c" is cosine), or NULL if there is none.
+ */
+const Metric *find_metric(const char *name) {
+    for (int i = 0; i < NUM_METRICS; i++) {
+        if (strncmp(name, metrics[i].name, strlen(name)) == 0) {
+            return &metrics[i];
+        }
+    }
+    return NULL;
+}
+
+
+/* A linear map of the images to a few dimensions, x -> basis (x - mean),
+ * that keeps their euclidean distances roughly as they were. The rows of
+ * basis are stride floats apart.
+ */
+struct Projection {
+    int dims;
+    int stride;               // dims rounded up to whole PROJ_LANES
+    float mean[NUM_PIXELS];
+    float *basis;             // dims rows of NUM_PIXELS weights
+};
+
+/* Most training images the covariance for PCA is estimated from, and the
+ * number of subspace iterations used to find its leading eigenvectors.
+ */
+#define PCA_SAMPLE 10000
+#define PCA_ITERATIONS 30
+
+/* out[i] += scale * in[i] for the n doubles of out, the inner loop of the
+ * products below.
+ */
+__attribute__((optimize("tree-vectorize"), target_clones("avx2", "default")))
+static void add_scaled(double *out, const double *in, double scale, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] += scale * in[i];
+    }
+}
+
+static struct Projection *new_projection(int dims) {
+    if (dims < 1 || dims > NUM_PIXELS) {
+        fprintf(stderr, "Cannot project the images to %d dimensions\n", dims);
+        exit(1);
+    }
+    struct Projection *p = malloc(sizeof(struct Projection));
+    if (p == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    p->dims = dims;
+    p->stride = (dims + PROJ_LANES - 1) / PROJ_LANES * PROJ_LANES;
+    p->basis = calloc((size_t)dims * NUM_PIXELS, sizeof(float));
+    if (p->basis == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return p;
+}
+
+/* Make the dims columns of the NUM_PIXELS x dims matrix q orthonormal, in
+ * order (modified Gram-Schmidt). A column that is (numerically) in the
+ * span of the ones before it is replaced by a unit vector.
+ */
+static void orthonormalize(double *q, int dims) {
+    for (int c = 0; c < dims; c++) {
+        for (int prev = 0; prev < c; prev++) {
+            double dot = 0;
+            for (int i = 0; i < NUM_PIXELS; i++) {
+                dot += q[i * dims + c] * q[i * dims + prev];
+            }
+            for (int i = 0; i < NUM_PIXELS; i++) {
+                q[i * dims + c] -= dot * q[i * dims + prev];
+            }
+        }
+        double norm = 0;
+        for (int i = 0; i < NUM_PIXELS; i++) {
+            norm += q[i * dims + c] * q[i * dims + c];
+        }
+        if (norm < 1e-20) {
+            for (int i = 0; i < NUM_PIXELS; i++) {
+                q[i * dims + c] = i == c;
+            }
+            c--;  // Orthogonalise the unit vector too
+            continue;
+        }
+        norm = sqrt(norm);
+        for (int i = 0; i < NUM_PIXELS; i++) {
+            q[i * dims + c] /= norm;
+        }
+    }
+}
+
+/**
+ * Learn a projection of the images to dims dimensions by principal
+ * component analysis of training: the directions in which its images vary
+ * the most. Distances in the projection are the distances between the
+ * images with only the variation along those directions left, so little
+ * is lost (the border pixels are almost always 0). The covariance is
+ * estimated from at most PCA_SAMPLE images spread through training.
+ */
+struct Projection *pca_projection(Dataset *training, int dims) {
+    struct Projection *p = new_projection(dims);
+    int n = training->num_items;
+    int step = n > PCA_SAMPLE ? (n + PCA_SAMPLE - 1) / PCA_SAMPLE : 1;
+
+    double *mean = calloc(NUM_PIXELS, sizeof(double));
+    double *cov = calloc((size_t)NUM_PIXELS * NUM_PIXELS, sizeof(double));
+    double *centred = malloc(sizeof(double) * NUM_PIXELS);
+    double *q = malloc(sizeof(double) * NUM_PIXELS * dims);
+    double *z = malloc(sizeof(double) * NUM_PIXELS * dims);
+    if (mean == NULL || cov == NULL || centred == NULL || q == NULL || z == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int sampled = 0;
+    for (int i = 0; i < n; i += step, sampled++) {
+        unsigned char *pixels = dataset_pixels(training, i);
+        for (int a = 0; a < NUM_PIXELS; a++) {
+            mean[a] += pixels[a];
+        }
+    }
+    for (int a = 0; a < NUM_PIXELS; a++) {
+        mean[a] /= sampled > 0 ? sampled : 1;
+        p->mean[a] = mean[a];
+    }
+
+    // The upper triangle of the covariance, then mirrored
+    for (int i = 0; i < n; i += step) {
+        unsigned char *pixels = dataset_pixels(training, i);
+        for (int a = 0; a < NUM_PIXELS; a++) {
+            centred[a] = pixels[a] - mean[a];
+        }
+        for (int a = 0; a < NUM_PIXELS; a++) {
+            add_scaled(cov + (size_t)a * NUM_PIXELS + a, centred + a, centred[a], NUM_PIXELS - a);
+        }
+    }
+    for (int a = 0; a < NUM_PIXELS; a++) {
+        for (int b = 0; b < a; b++) {
+            cov[(size_t)a * NUM_PIXELS + b] = cov[(size_t)b * NUM_PIXELS + a];
+        }
+    }
+
+    // Subspace iteration: q converges to the leading eigenvectors, in order
+    unsigned int seed = 209;
+    for (int i = 0; i < NUM_PIXELS * dims; i++) {
+        q[i] = rand_r(&seed) / (double)RAND_MAX - 0.5;
+    }
+    orthonormalize(q, dims);
+    for (int it = 0; it < PCA_ITERATIONS; it++) {
+        for (int a = 0; a < NUM_PIXELS; a++) {
+            double *row = cov + (size_t)a * NUM_PIXELS;
+            double *out = z + a * dims;
+            for (int c = 0; c < dims; c++) {
+                out[c] = 0;
+            }
+            for (int b = 0; b < NUM_PIXELS; b++) {
+                add_scaled(out, q + b * dims, row[b], dims);
+            }
+        }
+        orthonormalize(z, dims);
+        double *tmp = q;
+        q = z;
+        z = tmp;
+    }
+    for (int c = 0; c < dims; c++) {
+        for (int a = 0; a < NUM_PIXELS; a++) {
+            p->basis[(size_t)c * NUM_PIXELS + a] = q[a * dims + c];
+        }
+    }
+
+    free(mean);
+    free(cov);
+    free(centred);
+    free(q);
+    free(z);
+    return p;
+}
+
+/**
+ * Return a random projection of the images to dims dimensions, which
+ * needs no training: each dimension is the dot product with a vector of
+ * independent gaussian weights (from seed). By the Johnson-Lindenstrauss
+ * lemma distances are kept to within a factor that shrinks with dims,
+ * though more loosely than by PCA for the same dims.
+ */
+struct Projection *random_projection(int dims, unsigned int seed) {
+    struct Projection *p = new_projection(dims);
+    for (int a = 0; a < NUM_PIXELS; a++) {
+        p->mean[a] = 0;
+    }
+    for (size_t i = 0; i < (size_t)dims * NUM_PIXELS; i++) {
+        // Box-Muller
+        double u = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+        double v = rand_r(&seed) / (RAND_MAX + 1.0);
+        p->basis[i] = sqrt(-2 * log(u)) * cos(2 * M_PI * v) / sqrt(dims);
+    }
+    return p;
+}
+
+/* Set the p->stride floats of row to the projection of pixels by p.
+ */
+static void project_pixels(struct Projection *p, const unsigned char *pixels, float *row) {
+    float centred[NUM_PIXELS];
+    for (int a = 0; a < NUM_PIXELS; a++) {
+        centred[a] = pixels[a] - p->mean[a];
+    }
+    for (int c = 0; c < p->stride; c++) {
+        float sum = 0;
+        if (c < p->dims) {
+            float *weights = p->basis + (size_t)c * NUM_PIXELS;
+            for (int a = 0; a < NUM_PIXELS; a++) {
+                sum += weights[a] * centred[a];
+            }
+        }
+        row[c] = sum;
+    }
+}
+
+/**
+ * Project every image in data with p. The projections are kept together
+ * in data->proj, and each image's proj points at its row. From then on,
+ * knn_predict with distance_euclidean ranks the images of data by the
+ * distance between their projections and the input's (which must have
+ * been projected with the same p) instead of between their pixels.
+ */
+void project_dataset(Dataset *data, struct Projection *p) {
+    free(data->proj);
+    size_t size = (size_t)data->num_items * p->stride * sizeof(float);
+    if (posix_memalign((void **)&data->proj, SLAB_ALIGN, size > 0 ? size : SLAB_ALIGN) != 0) {
+        fprintf(stderr, "Could not allocate the projected images\n");
+        exit(1);
+    }
+    data->proj_stride = p->stride;
+    for (int i = 0; i < data->num_items; i++) {
+        float *row = data->proj + (size_t)i * p->stride;
+        project_pixels(p, dataset_pixels(data, i), row);
+        data->images[i].proj = row;
+    }
+}
+
+/**
+ * Free a projection made by pca_projection or random_projection.
+ */
+void free_projection(struct Projection *p) {
+    if (p == NULL) {
+        return;
+    }
+    free(p->basis);
+    free(p);
+}
+
+/* Server mode (see worker_handler and classify_batches): the parent and a
+ * worker exchange messages of an int length followed by that many bytes.
+ * A batch of test images is the index of the first one followed by their
+ * pixels, and its predictions are the index followed by one byte each. An
+ * empty message tells the worker to exit.
+ */
+
+/* Write all of the n bytes of buf to fd, or exit. */
+static void write_fully(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t written = write(fd, p, n);
+        if (written == -1) {
+            perror("write");
+            exit(1);
+        }
+        p += written;
+        n -= written;
+    }
+}
+
+/* Read all of the n bytes of buf from fd, or exit. Return 0 if fd is at
+ * the end of file before the first byte.
+ */
+static int read_fully(int fd, void *buf, size_t n) {
+    char *p = buf;
+    size_t total = n;
+    while (n > 0) {
+        ssize_t got = read(fd, p, n);
+        if (got == -1) {
+            perror("read");
+            exit(1);
+        }
+        if (got == 0) {
+            if (n == total) {
+                return 0;
+            }
+            fprintf(stderr, "Truncated message\n");
+            exit(1);
+        }
+        p += got;
+        n -= got;
+    }
+    return 1;
+}
+
+/**
+ * Send a message of length bytes from payload to fd.
+ */
+void send_message(int fd, const void *payload, int length) {
+    write_fully(fd, &length, sizeof(int));
+    write_fully(fd, payload, length);
+}
+
+/**
+ * Receive a message from fd into payload, which has room for capacity
+ * bytes, and return its length, or -1 if fd was closed between messages.
+ */
+int receive_message(int fd, void *payload, int capacity) {
+    int length;
+    if (!read_fully(fd, &length, sizeof(int))) {
+        return -1;
+    }
+    if (length < 0 || length > capacity) {
+        fprintf(stderr, "Message of %d bytes does not fit in %d\n", length, capacity);
+        exit(1);
+    }
+    read_fully(fd, payload, length);
+    return length;
+}
+
+/**
+ * worker_handler is called by each worker process of the classifier's
+ * server mode, forked once the training set is loaded (and preprocessed).
+ * It classifies the batches of test images it receives through p_in,
+ * sending the predictions back through p_out, until it gets an empty
+ * message. Each image is binarized if training is, and projected with
+ * projection (which may be NULL) as project_dataset would, so the
+ * predictions are the same as for a loaded testing set.
+ */
+void worker_handler(Dataset *training, int K, double (*fptr)(Image *, Image *),
+                    struct Projection *projection, int p_in, int p_out) {
+    int capacity = sizeof(int) + BATCH_IMAGES * NUM_PIXELS;
+    unsigned char *batch = malloc(capacity);
+    unsigned char *reply = malloc(sizeof(int) + BATCH_IMAGES);
+    unsigned long long *bits = malloc(sizeof(unsigned long long) * BIT_WORDS);
+    float *proj = NULL;
+    if (projection != NULL && posix_memalign((void **)&proj, SLAB_ALIGN,
+                                             sizeof(float) * projection->stride) != 0) {
+        proj = NULL;
+    }
+    if (batch == NULL || reply == NULL || bits == NULL || (projection != NULL && proj == NULL)) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int length;
+    while ((length = receive_message(p_in, batch, capacity)) > 0) {
+        int count = (length - (int)sizeof(int)) / NUM_PIXELS;
+        memcpy(reply, batch, sizeof(int));
+        for (int i = 0; i < count; i++) {
+            Image input;
+            input.sx = WIDTH;
+            input.sy = WIDTH;
+            input.data = batch + sizeof(int) + (size_t)i * NUM_PIXELS;
+            input.bits = NULL;
+            input.proj = NULL;
+            if (training->bits != NULL) {
+                binarize_pixels(input.data, bits);
+                input.bits = bits;
+            }
+            if (projection != NULL) {
+                project_pixels(projection, input.data, proj);
+                input.proj = proj;
+            }
+            reply[sizeof(int) + i] = knn_predict(training, &input, K, fptr);
+        }
+        send_message(p_out, reply, sizeof(int) + count);
+    }
+
+    free(batch);
+    free(reply);
+    free(bits);
+    free(proj);
+}
+
+/**
+ * Classify every image of testing with the num_workers workers (see
+ * worker_handler) listening on to_workers and answering on from_workers,
+ * and return the number classified correctly. The images go out in
+ * batches of BATCH_IMAGES, at most two to a worker at a time so that it
+ * has the next one as soon as it is done, and each worker gets the next
+ * batch when it answers: a fast worker does more of them.
+ */
+int classify_batches(Dataset *testing, int num_workers, int *to_workers, int *from_workers) {
+    int capacity = sizeof(int) + BATCH_IMAGES * NUM_PIXELS;
+    unsigned char *batch = malloc(capacity);
+    unsigned char *reply = malloc(sizeof(int) + BATCH_IMAGES);
+    int *in_flight = calloc(num_workers > 0 ? num_workers : 1, sizeof(int));
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * (num_workers > 0 ? num_workers : 1));
+    if (batch == NULL || reply == NULL || in_flight == NULL || fds == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int next = 0, outstanding = 0, correct = 0;
+    while (next < testing->num_items || outstanding > 0) {
+        for (int w = 0; w < num_workers; w++) {
+            while (in_flight[w] < 2 && next < testing->num_items) {
+                int count = testing->num_items - next;
+                count = count < BATCH_IMAGES ? count : BATCH_IMAGES;
+                memcpy(batch, &next, sizeof(int));
+                for (int i = 0; i < count; i++) {
+                    memcpy(batch + sizeof(int) + (size_t)i * NUM_PIXELS,
+                           dataset_pixels(testing, next + i), NUM_PIXELS);
+                }
+                send_message(to_workers[w], batch, sizeof(int) + count * NUM_PIXELS);
+                next += count;
+                in_flight[w]++;
+                outstanding++;
+            }
+        }
+        if (outstanding == 0) {
+            break;
+        }
+
+        for (int w = 0; w < num_workers; w++) {
+            fds[w].fd = in_flight[w] > 0 ? from_workers[w] : -1;
+            fds[w].events = POLLIN;
+            fds[w].revents = 0;
+        }
+        if (poll(fds, num_workers, -1) == -1) {
+            perror("poll");
+            exit(1);
+        }
+        for (int w = 0; w < num_workers; w++) {
+            if (fds[w].revents == 0) {
+                continue;
+            }
+            int length = receive_message(from_workers[w], reply, sizeof(int) + BATCH_IMAGES);
+            if (length < (int)sizeof(int)) {
+                fprintf(stderr, "Worker %d exited\n", w);
+                exit(1);
+            }
+            int start;
+            memcpy(&start, reply, sizeof(int));
+            for (int i = 0; i < length - (int)sizeof(int); i++) {
+                correct += reply[sizeof(int) + i] == testing->labels[start + i];
+            }
+            in_flight[w]--;
+            outstanding--;
+        }
+    }
+
+    free(batch);
+    free(reply);
+    free(in_flight);
+    free(fds);
+    return correct;
+}
+
+/* What each thread of sweep_neighbours works on. */
+typedef struct {
+    Dataset *data;
+    Image *queries;
+    int Kmax;
+    double (*fptr)(Image *, Image *);
+    struct WorkQueue *queue;
+    int worker;
+    unsigned char *predictions;
+} SweepWorker;
+
+static void *sweep_worker(void *arg) {
+    SweepWorker *w = arg;
+    Knn_item nearest[w->Kmax], kept[w->Kmax];
+    Knn_item *log = malloc(sizeof(Knn_item) * (w->data->num_items > 0 ? w->data->num_items : 1));
+    if (log == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int first, count;
+    while ((count = next_chunk(w->queue, w->worker, &first)) > 0) {
+        for (int q = first; q < first + count; q++) {
+            Knn_heap heap = {nearest, 0, w->Kmax, log, 0};
+            knn_search(w->data, &w->queries[q], w->fptr, &heap);
+            // Any image that did not get into the heap was no nearer than
+            // the Kmax-th nearest so far, so would not have got into a
+            // smaller one either: offering just those that did, in the same
+            // order, keeps the same images (see Knn_heap) as searching with
+            // each smaller K would
+            unsigned char *row = w->predictions + (size_t)q * w->Kmax;
+            for (int k = 1; k <= w->Kmax; k++) {
+                Knn_heap smaller = {kept, 0, k};
+                for (int i = 0; i < heap.logged; i++) {
+                    knn_heap_offer(&smaller, log[i].dist, log[i].img_idx);
+                }
+                row[k - 1] = knn_vote(w->data, &smaller);
+            }
+        }
+    }
+    free(log);
+    return NULL;
+}
+
+/**
+ * Store in predictions[q * Kmax + k - 1] the label knn_predict(data,
+ * &queries[q], k, fptr) gives, for each of the num_queries queries and
+ * every k from 1 to Kmax (at least 1). Each query is compared with the
+ * images of data just once, and the images that got among its Kmax
+ * nearest on the way are enough to pick its k nearest for every k, by
+ * num_threads threads taking the queries from a queue.
+ */
+void sweep_neighbours(Dataset *data, Image *queries, int num_queries, int Kmax,
+                      double (*fptr)(Image *, Image *), int num_threads,
+                      unsigned char *predictions) {
+    struct WorkQueue *queue = new_work_queue(num_queries, num_threads, 1);
+    pthread_t threads[num_threads > 0 ? num_threads : 1];
+    SweepWorker workers[num_threads > 0 ? num_threads : 1];
+    for (int t = 0; t < num_threads; t++) {
+        workers[t] = (SweepWorker){data, queries, Kmax, fptr, queue, t, predictions};
+        if (pthread_create(&threads[t], NULL, sweep_worker, &workers[t]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free_work_queue(queue);
+}
+
+/* Copy the num_items images of data listed in items, with their labels and
+ * binarized rows, into a new Dataset laid out as a slab that is searched
+ * in the same block order.
+ */
+static Dataset *dataset_subset(Dataset *data, const int *items, int num_items) {
+    Dataset *subset = new_dataset(num_items);
+    memcpy(subset->block_order, data->block_order, sizeof(data->block_order));
+    size_t slab_size = (size_t)num_items * SLAB_STRIDE;
+    size_t bits_size = (size_t)num_items * BIT_WORDS * sizeof(unsigned long long);
+    if (subset->labels == NULL || subset->images == NULL ||
+        posix_memalign((void **)&subset->slab, SLAB_ALIGN, slab_size > 0 ? slab_size : SLAB_ALIGN) != 0 ||
+        (data->bits != NULL &&
+         posix_memalign((void **)&subset->bits, SLAB_ALIGN, bits_size > 0 ? bits_size : SLAB_ALIGN) != 0)) {
+        fprintf(stderr, "Could not allocate a subset of the training set\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_items; i++) {
+        unsigned char *row = subset->slab + (size_t)i * SLAB_STRIDE;
+        memcpy(row, dataset_pixels(data, items[i]), NUM_PIXELS);
+        memset(row + NUM_PIXELS, 0, SLAB_STRIDE - NUM_PIXELS);
+        subset->labels[i] = data->labels[items[i]];
+        subset->images[i].data = row;
+        subset->images[i].sqnorm = data->images[items[i]].sqnorm;
+        if (subset->bits != NULL) {
+            subset->images[i].bits = subset->bits + (size_t)i * BIT_WORDS;
+            memcpy(subset->images[i].bits, data->images[items[i]].bits,
+                   BIT_WORDS * sizeof(unsigned long long));
+        }
+    }
+    return subset;
+}
+
+/**
+ * Score every K from 1 to Kmax for the metric fptr, using num_threads
+ * threads (see sweep_neighbours). Store in cv_correct[K - 1] the number
+ * of training images predicted correctly with folds-fold cross-validation
+ * (training image i is in fold i % folds, and the images of each fold are
+ * classified against those of the others), and in test_correct[K - 1] the
+ * number of images of testing predicted correctly against all of training.
+ */
+void cross_validate(Dataset *training, Dataset *testing, int folds, int Kmax,
+                    double (*fptr)(Image *, Image *), int num_threads, int *cv_correct,
+                    int *test_correct) {
+    int most = training->num_items > testing->num_items ? training->num_items : testing->num_items;
+    unsigned char *predictions = malloc((size_t)(most > 0 ? most : 1) * Kmax);
+    int *rest = malloc(sizeof(int) * (training->num_items > 0 ? training->num_items : 1));
+    Image *held = malloc(sizeof(Image) * (training->num_items > 0 ? training->num_items : 1));
+    if (predictions == NULL || rest == NULL || held == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    memset(cv_correct, 0, sizeof(int) * Kmax);
+    for (int f = 0; f < folds; f++) {
+        int num_rest = 0, num_held = 0;
+        for (int i = 0; i < training->num_items; i++) {
+            if (i % folds == f) {
+                held[num_held++] = training->images[i];
+            } else {
+                rest[num_rest++] = i;
+            }
+        }
+        Dataset *others = dataset_subset(training, rest, num_rest);
+        sweep_neighbours(others, held, num_held, Kmax, fptr, num_threads, predictions);
+        for (int j = 0; j < num_held; j++) {
+            unsigned char label = training->labels[f + j * folds];
+            for (int k = 0; k < Kmax; k++) {
+                cv_correct[k] += predictions[(size_t)j * Kmax + k] == label;
+            }
+        }
+        free_dataset(others);
+    }
+
+    memset(test_correct, 0, sizeof(int) * Kmax);
+    sweep_neighbours(training, testing->images, testing->num_items, Kmax, fptr, num_threads,
+                     predictions);
+    for (int j = 0; j < testing->num_items; j++) {
+        for (int k = 0; k < Kmax; k++) {
+            test_correct[k] += predictions[(size_t)j * Kmax + k] == testing->labels[j];
+        }
+    }
+
+    free(predictions);
+    free(rest);
+    free(held);
 }
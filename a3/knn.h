@@ -7,29 +7,163 @@
  * file, so they do not interfere with anything else.
  */
 
+#include <stddef.h>
+
 #define WIDTH 28
-#define NUM_PIXELS WIDTH * WIDTH
+#define NUM_PIXELS (WIDTH * WIDTH)
+
+/* Size of one label + image record in the dataset files */
+#define RECORD_SIZE (1 + NUM_PIXELS)
+
+/* Bytes between the rows of a slab (NUM_PIXELS rounded up to whole cache
+ * lines), and the alignment of the slab */
+#define SLAB_STRIDE 832
+#define SLAB_ALIGN 64
+
+/* The euclidean search compares the pixels one block (a cache line of
+ * BLOCK_PIXELS pixels) at a time (see order_blocks_by_variance) */
+#define BLOCK_PIXELS 64
+#define NUM_BLOCKS ((NUM_PIXELS + BLOCK_PIXELS - 1) / BLOCK_PIXELS)
+
+/* Number of 64-bit words in a binarized image, which has one bit per pixel
+ * that is set if the pixel is at least BIT_THRESHOLD */
+#define BIT_WORDS ((NUM_PIXELS + 63) / 64)
+#define BIT_THRESHOLD 128
+
+/* Projected images (see project_dataset) are rows of floats padded with
+ * zeros to a multiple of PROJ_LANES */
+#define PROJ_LANES 8
+
+/* Most test images in one message to a worker in server mode */
+#define BATCH_IMAGES 64
+
+/* Most predictions a worker makes before publishing them to the parent
+ * (see wait_for_results) */
+#define RESULT_BATCH 16
 
 /* This struct stores the data for an image */
 typedef struct {
     int sx;               // x resolution
     int sy;               // y resolution
     unsigned char *data;  // List of `sx * sy` pixel color values [0-255]
+    unsigned int sqnorm;  // Sum of the squares of the pixels, set when loaded
+    unsigned long long *bits;  // BIT_WORDS words of binarized pixels, or NULL
+    float *proj;          // The projected image (see project_dataset), or NULL
 } Image;
 
+/* Indexes over the images of a Dataset (see build_vptree and build_hnsw) */
+struct VpTree;
+struct Hnsw;
+
+/* A map of the images to fewer dimensions (see pca_projection) */
+struct Projection;
+
+/* The test images of a run, shared by its children (see new_work_queue) */
+struct WorkQueue;
+
+/* The CPUs and NUMA nodes the workers go on (see new_placement) */
+struct Placement;
+
+/* The predictions of a run, shared by its workers (see new_result_area) */
+struct ResultArea;
+
+/* The prediction for one test image, as a worker stores it in its slot */
+typedef struct {
+    int img_idx;          // Index of the image in the testing set
+    float kth_dist;       // Distance to the K-th nearest training image
+    unsigned char label;  // Predicted label
+} PredictionRecord;
+
+/* A distance metric knn_predict knows (see metrics and find_metric) */
+typedef struct {
+    const char *name;                  // Full name, of which -d may give a prefix
+    double (*fptr)(Image *, Image *);  // The distance between two images
+    int binarized;                     // If 1, it compares binarized images (see binarize_dataset)
+} Metric;
+
+#define NUM_METRICS 5
+
 /* This struct stores the images / labels in the dataset */
 typedef struct {
     int num_items;          // Number of images in the dataset
     Image *images;          // List of `num_items` Image structs
     unsigned char *labels;  // List of `num_items` labels [0-9]
+    void *map;              // The mapped dataset file the images point into, or NULL
+    size_t map_size;        // Length of the mapping in bytes
+    unsigned char *slab;    // `num_items` rows of SLAB_STRIDE pixels, or NULL
+    unsigned long long *bits;  // `num_items` binarized rows of BIT_WORDS, or NULL
+    struct VpTree *vptree;  // Index knn_predict searches instead, or NULL
+    struct Hnsw *hnsw;      // Approximate index searched instead, or NULL
+    float *proj;            // `num_items` projected rows of proj_stride, or NULL
+    int proj_stride;        // Floats per projected row
+    int block_order[NUM_BLOCKS];  // Order the euclidean search compares blocks in
 } Dataset;
 
+/* Return the pixels of image i of data, from its slab if it has one */
+static inline unsigned char *dataset_pixels(Dataset *data, int i) {
+    if (data->slab != NULL) {
+        return data->slab + (size_t)i * SLAB_STRIDE;
+    }
+    return data->images[i].data;
+}
+
 double distance_euclidean(Image *a, Image *b);
 
 Dataset *load_dataset(const char *filename);
+Dataset *load_dataset_slab(const char *filename);
 void free_dataset(Dataset *data);
 
 // New for A3!
 double distance_cosine(Image *a, Image *b);
+double distance_hamming(Image *a, Image *b);
+double distance_manhattan(Image *a, Image *b);
+double distance_chebyshev(Image *a, Image *b);
+extern const Metric metrics[NUM_METRICS];
+const Metric *find_metric(const char *name);
+void binarize_dataset(Dataset *data);
+void order_blocks_by_variance(Dataset *data);
+void knn_pixel_stats(long long *compared, long long *skipped);
+void build_vptree(Dataset *data, double (*fptr)(Image *, Image *));
+int attach_vptree(Dataset *data, const char *filename, double (*fptr)(Image *, Image *),
+                  const char *metric);
+void free_vptree(Dataset *data);
+void knn_vptree_stats(long long *computed, long long *searched);
+void build_hnsw(Dataset *data, double (*fptr)(Image *, Image *), int M, int ef);
+void free_hnsw(Dataset *data);
+struct Projection *pca_projection(Dataset *training, int dims);
+struct Projection *random_projection(int dims, unsigned int seed);
+void project_dataset(Dataset *data, struct Projection *p);
+void free_projection(struct Projection *p);
 int knn_predict(Dataset *data, Image *img, int K, double (*fptr)(Image *,Image *));
-void child_handler(Dataset *training, Dataset *testing, int K, double (*fptr)(Image *, Image *),int p_in, int p_out);
+int knn_predict_distance(Dataset *data, Image *input, int K, double (*fptr)(Image *, Image *),
+                         double *kth_dist);
+void sweep_neighbours(Dataset *data, Image *queries, int num_queries, int Kmax,
+                      double (*fptr)(Image *, Image *), int num_threads,
+                      unsigned char *predictions);
+void cross_validate(Dataset *training, Dataset *testing, int folds, int Kmax,
+                    double (*fptr)(Image *, Image *), int num_threads, int *cv_correct,
+                    int *test_correct);
+void send_message(int fd, const void *payload, int length);
+int receive_message(int fd, void *payload, int capacity);
+void worker_handler(Dataset *training, int K, double (*fptr)(Image *, Image *),
+                    struct Projection *projection, int p_in, int p_out);
+int classify_batches(Dataset *testing, int num_workers, int *to_workers, int *from_workers);
+struct WorkQueue *new_work_queue(int num_items, int num_workers, int dynamic);
+void free_work_queue(struct WorkQueue *queue);
+void child_handler_queue(Dataset *training, Dataset *testing, int K,
+                         double (*fptr)(Image *, Image *), struct WorkQueue *queue, int worker,
+                         struct ResultArea *results);
+int classify_threads(Dataset *training, Dataset *testing, int K,
+                     double (*fptr)(Image *, Image *), struct WorkQueue *queue,
+                     struct ResultArea *results, struct Placement *placement, int verbose);
+struct Placement *new_placement(Dataset *training, int replicate);
+Dataset *place_worker(struct Placement *p, Dataset *training, int worker,
+                      struct WorkQueue *queue);
+void free_placement(struct Placement *p);
+void print_work_stats(struct WorkQueue *queue);
+struct ResultArea *new_result_area(int num_items);
+PredictionRecord *result_records(struct ResultArea *area);
+void free_result_area(struct ResultArea *area);
+int wait_for_results(struct ResultArea *area, int num_children, int verbose);
+void write_predictions(const char *filename, Dataset *testing, PredictionRecord *records);
+void print_confusion_matrix(Dataset *testing, PredictionRecord *records);